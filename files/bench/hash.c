@@ -0,0 +1,203 @@
+// Compares the intern table's string hash (hash.h) with the byte-at-a-time FNV-1a it replaced. Run it from the
+// files/ directory:
+//
+//     cc -O2 -o bench/hash bench/hash.c && bench/hash
+//
+// It reports hashing throughput for a range of string lengths, then hashes sets of keys shaped like what the
+// VM interns (identifiers, numbered names, strings built by appending) and reports full 32-bit collisions and
+// how a table laid out like table.c would probe: groups looked at and control-byte false matches per lookup.
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../hash.h"
+
+#define KEY_COUNT 100000
+#define GROUP 16
+
+typedef uint32_t (*HashFn)(const char *key, int length);
+
+static uint32_t fnv1a(const char *key, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static const struct
+{
+    const char *name;
+    HashFn hash;
+} hashes[] = {
+    {"fnv1a", fnv1a},
+    {"npa", hashString},
+};
+
+#define HASH_COUNT (int)(sizeof(hashes) / sizeof(hashes[0]))
+
+static double now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Hashes about 256 MB in strings of the given length; the buffer is varied so nothing is hoisted out.
+static void measureThroughput(int length)
+{
+    char *buffer = malloc(length + 64);
+    for (int i = 0; i < length + 64; i++)
+        buffer[i] = (char)('a' + i % 26);
+
+    long iterations = (256L << 20) / length;
+    printf("%8d", length);
+    for (int h = 0; h < HASH_COUNT; h++)
+    {
+        uint32_t sink = 0;
+        double start = now();
+        for (long i = 0; i < iterations; i++)
+            sink += hashes[h].hash(buffer + (i & 63), length);
+        double seconds = now() - start;
+        printf(" %10.2f %8.2f", (double)iterations * length / seconds / 1e9, seconds / iterations * 1e9);
+        if (sink == 1)
+            printf("!");
+    }
+    printf("\n");
+    free(buffer);
+}
+
+static int compareHashes(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Inserts the hashes into control bytes laid out like table.c (7-bit tags, groups of 16 probed in triangular
+// steps, at most 7/16 full after growing), then looks every key up again.
+static void measureTable(uint32_t *keyHashes, int count, double *groups, double *falseMatches)
+{
+    int capacity = GROUP;
+    while (count > capacity / 16 * 7)
+        capacity *= 2;
+
+    uint8_t *control = malloc(capacity);
+    memset(control, 0x80, capacity);
+    int *slots = malloc(sizeof(int) * count);
+    uint32_t groupMask = (uint32_t)capacity / GROUP - 1;
+
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t group = (keyHashes[i] >> 7) & groupMask;
+        for (uint32_t step = 1;; group = (group + step++) & groupMask)
+        {
+            int slot = -1;
+            for (int j = 0; j < GROUP && slot < 0; j++)
+            {
+                if (control[group * GROUP + j] == 0x80)
+                    slot = (int)(group * GROUP) + j;
+            }
+            if (slot >= 0)
+            {
+                control[slot] = keyHashes[i] & 0x7F;
+                slots[i] = slot;
+                break;
+            }
+        }
+    }
+
+    long probed = 0, falseCount = 0;
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t group = (keyHashes[i] >> 7) & groupMask;
+        for (uint32_t step = 1;; group = (group + step++) & groupMask)
+        {
+            probed++;
+            bool found = false;
+            for (int j = 0; j < GROUP; j++)
+            {
+                int slot = (int)(group * GROUP) + j;
+                if (slot == slots[i])
+                    found = true;
+                else if (control[slot] == (keyHashes[i] & 0x7F))
+                    falseCount++;
+            }
+            if (found)
+                break;
+        }
+    }
+
+    *groups = (double)probed / count;
+    *falseMatches = (double)falseCount / count;
+    free(control);
+    free(slots);
+}
+
+static void makeKey(int set, int i, char *key)
+{
+    switch (set)
+    {
+    case 0: // Short identifiers.
+        sprintf(key, "v%d", i);
+        break;
+    case 1: // Longer identifiers that differ only at the end.
+        sprintf(key, "handle_request_%d", i);
+        break;
+    case 2: // Strings built by appending: a shared prefix and a counter.
+        sprintf(key, "line %d of the report: ok", i);
+        break;
+    }
+}
+
+static const char *keySets[] = {"v<i>", "handle_request_<i>", "line <i> of the report: ok"};
+
+int main()
+{
+    printf("Throughput, GB/s and ns per string:\n");
+    printf("%8s", "length");
+    for (int h = 0; h < HASH_COUNT; h++)
+        printf(" %10s %8s", hashes[h].name, "ns");
+    printf("\n");
+    int lengths[] = {3, 8, 16, 24, 64, 256, 4096};
+    for (int i = 0; i < (int)(sizeof(lengths) / sizeof(lengths[0])); i++)
+        measureThroughput(lengths[i]);
+
+    printf("\nCollisions over %d keys:\n", KEY_COUNT);
+    printf("%-28s %-6s %10s %10s %14s\n", "keys", "hash", "collisions", "groups", "false matches");
+    uint32_t *keyHashes = malloc(sizeof(uint32_t) * KEY_COUNT);
+    uint32_t *sorted = malloc(sizeof(uint32_t) * KEY_COUNT);
+    for (int set = 0; set < (int)(sizeof(keySets) / sizeof(keySets[0])); set++)
+    {
+        for (int h = 0; h < HASH_COUNT; h++)
+        {
+            char key[64];
+            for (int i = 0; i < KEY_COUNT; i++)
+            {
+                makeKey(set, i, key);
+                keyHashes[i] = hashes[h].hash(key, (int)strlen(key));
+            }
+
+            memcpy(sorted, keyHashes, sizeof(uint32_t) * KEY_COUNT);
+            qsort(sorted, KEY_COUNT, sizeof(uint32_t), compareHashes);
+            int collisions = 0;
+            for (int i = 1; i < KEY_COUNT; i++)
+            {
+                if (sorted[i] == sorted[i - 1])
+                    collisions++;
+            }
+
+            double groups, falseMatches;
+            measureTable(keyHashes, KEY_COUNT, &groups, &falseMatches);
+            printf("%-28s %-6s %10d %10.3f %14.3f\n", keySets[set], hashes[h].name, collisions, groups, falseMatches);
+        }
+    }
+    free(keyHashes);
+    free(sorted);
+    return 0;
+}
@@ -0,0 +1,372 @@
+// Benchmark runner for npa. Run it from the files/ directory:
+//
+//     cc -O2 -o bench/runner bench/runner.c && bench/runner --save bench/baseline.json
+//     ... change the VM ...
+//     bench/runner --baseline bench/baseline.json
+//
+// It builds a release interpreter from *.c, runs every benchmark several times and reports the median wall
+// time, the median instructions retired (Linux perf_event_open, when the kernel allows it) and the peak RSS.
+// Given a baseline written by an earlier --save, it flags every metric that got worse by more than the
+// threshold and exits with status 1. Baselines are only comparable on the machine that recorded them.
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
+
+#define MAX_RUNS 50
+
+typedef struct
+{
+    const char *name;
+    const char *path;   // Script to run; NULL for the generated compile benchmark.
+    const char *option; // Interpreter option to run it with, or NULL.
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+    {"fib", "bench/fib.npa", NULL},
+    {"closures", "bench/closures.npa", NULL},
+    {"strings", "bench/strings.npa", NULL},
+    {"intern", "bench/intern.npa", NULL},
+    {"globals", "bench/globals.npa", NULL},
+    {"gc", "bench/gc.npa", NULL},
+    {"heap", "bench/heap.npa", NULL},
+    {"heap-inc", "bench/heap.npa", "--gc-pause=1000"},
+    {"heap-conc", "bench/heap.npa", "--gc-concurrent"},
+    {"compile", NULL, NULL},
+};
+
+#define BENCHMARK_COUNT (int)(sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// The metrics for one benchmark. Instructions are 0 when they couldn't be counted.
+typedef struct
+{
+    double seconds;
+    uint64_t instructions;
+    long rssKb;
+} Result;
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int compareCounts(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Writes a source file with lots of small functions, nested in groups so no chunk runs out of constants.
+// Running it mostly measures the scanner and compiler.
+static bool writeCompileBenchmark(const char *path)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    for (int group = 0; group < 200; group++)
+    {
+        fprintf(file, "fun group%d()\n{\n", group);
+        for (int i = 0; i < 100; i++)
+        {
+            fprintf(file, "    fun f%d(a, b)\n    {\n", i);
+            fprintf(file, "        var c = a + b * %d;\n", i);
+            fprintf(file, "        if (c < %d) { c = c - 1; } else { c = c + 2; }\n", i * 3);
+            fprintf(file, "        while (c < 10) c = c + 1;\n");
+            fprintf(file, "        return c + \"s%d\";\n    }\n", i);
+        }
+        fprintf(file, "    return f0;\n}\n");
+    }
+    fprintf(file, "print group0;\n");
+    return fclose(file) == 0;
+}
+
+// Opens an instruction counter that the next exec'd child inherits and enables. Returns -1 when counting
+// isn't available (not Linux, no PMU in a VM, or perf_event_paranoid too strict).
+static int openInstructionCounter()
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.inherit = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+    return -1;
+#endif
+}
+
+// Runs the interpreter on one script, with option if it isn't NULL, with stdout discarded.
+static bool runOnce(const char *npa, const char *script, const char *option, double *seconds, uint64_t *instructions,
+                    long *rssKb)
+{
+    int counter = openInstructionCounter();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t child = fork();
+    if (child < 0)
+        return false;
+    if (child == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        if (option != NULL)
+            execl(npa, npa, option, script, (char *)NULL);
+        else
+            execl(npa, npa, script, (char *)NULL);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    wait4(child, &status, 0, &usage);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    *seconds = (double)(end.tv_sec - start.tv_sec) + (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    // ru_maxrss is in kilobytes on Linux and in bytes on macOS.
+#ifdef __APPLE__
+    *rssKb = usage.ru_maxrss / 1024;
+#else
+    *rssKb = usage.ru_maxrss;
+#endif
+    *instructions = 0;
+    if (counter >= 0)
+    {
+        uint64_t count;
+        if (read(counter, &count, sizeof(count)) == (ssize_t)sizeof(count))
+            *instructions = count;
+        close(counter);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "runner: %s failed on %s.\n", npa, script);
+        return false;
+    }
+    return true;
+}
+
+static bool runBenchmark(const char *npa, const char *script, const char *option, int runs, Result *result)
+{
+    double seconds[MAX_RUNS];
+    uint64_t instructions[MAX_RUNS];
+    result->rssKb = 0;
+
+    for (int run = 0; run < runs; run++)
+    {
+        long rssKb;
+        if (!runOnce(npa, script, option, &seconds[run], &instructions[run], &rssKb))
+            return false;
+        if (rssKb > result->rssKb)
+            result->rssKb = rssKb;
+    }
+
+    qsort(seconds, runs, sizeof(double), compareDoubles);
+    qsort(instructions, runs, sizeof(uint64_t), compareCounts);
+    result->seconds = seconds[runs / 2];
+    result->instructions = instructions[runs / 2];
+    return true;
+}
+
+// Reads one benchmark's entry from a baseline in the format saveResults() writes.
+static bool findBaseline(const char *json, const char *name, Result *result)
+{
+    char key[64];
+    snprintf(key, sizeof(key), "\"%s\":", name);
+    const char *entry = strstr(json, key);
+    if (entry == NULL)
+        return false;
+
+    unsigned long long instructions;
+    if (sscanf(entry + strlen(key), " { \"seconds\": %lf, \"instructions\": %llu, \"rss_kb\": %ld }",
+               &result->seconds, &instructions, &result->rssKb) != 3)
+        return false;
+    result->instructions = instructions;
+    return true;
+}
+
+static char *readBaseline(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    char *json = malloc(size + 1);
+    size_t bytesRead = fread(json, 1, size, file);
+    json[bytesRead] = '\0';
+    fclose(file);
+    return json;
+}
+
+static bool saveResults(const char *path, Result *results)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "{\n");
+    for (int i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        fprintf(file, "  \"%s\": { \"seconds\": %.6f, \"instructions\": %llu, \"rss_kb\": %ld }%s\n",
+                benchmarks[i].name, results[i].seconds, (unsigned long long)results[i].instructions,
+                results[i].rssKb, i + 1 < BENCHMARK_COUNT ? "," : "");
+    }
+    fprintf(file, "}\n");
+    return fclose(file) == 0;
+}
+
+// Prints a metric's change against the baseline and returns whether it regressed.
+static bool compareMetric(double now, double before, double threshold)
+{
+    if (before <= 0 || now <= 0)
+    {
+        printf(" %10s", "");
+        return false;
+    }
+
+    double change = (now - before) / before * 100.0;
+    bool regressed = change > threshold;
+    printf(" %+8.1f%%%s", change, regressed ? "!" : " ");
+    return regressed;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: bench/runner [--npa path] [--runs n] [--threshold percent] [--baseline file]"
+                    " [--save file]\n");
+    exit(64);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *npa = NULL;
+    const char *baselinePath = NULL;
+    const char *savePath = NULL;
+    int runs = 5;
+    double threshold = 5.0;
+
+    for (int arg = 1; arg < argc; arg++)
+    {
+        if (arg + 1 == argc)
+            usage();
+        if (strcmp(argv[arg], "--npa") == 0)
+            npa = argv[++arg];
+        else if (strcmp(argv[arg], "--runs") == 0)
+            runs = atoi(argv[++arg]);
+        else if (strcmp(argv[arg], "--threshold") == 0)
+            threshold = atof(argv[++arg]);
+        else if (strcmp(argv[arg], "--baseline") == 0)
+            baselinePath = argv[++arg];
+        else if (strcmp(argv[arg], "--save") == 0)
+            savePath = argv[++arg];
+        else
+            usage();
+    }
+    if (runs < 1 || runs > MAX_RUNS)
+        usage();
+
+    // Builds a release interpreter unless one was given.
+    if (npa == NULL)
+    {
+        npa = "bench/npa-release";
+        const char *command = "cc -O2 -std=gnu11 -DNDEBUG -o bench/npa-release *.c -lm";
+        printf("%s\n", command);
+        if (system(command) != 0)
+        {
+            fprintf(stderr, "runner: build failed.\n");
+            return 1;
+        }
+    }
+
+    char compilePath[] = "/tmp/npa-compile-XXXXXX.npa";
+    int compileFile = mkstemps(compilePath, 4);
+    if (compileFile < 0 || !writeCompileBenchmark(compilePath))
+    {
+        fprintf(stderr, "runner: could not write the compile benchmark.\n");
+        return 1;
+    }
+    close(compileFile);
+
+    char *baseline = baselinePath != NULL ? readBaseline(baselinePath) : NULL;
+    if (baselinePath != NULL && baseline == NULL)
+    {
+        fprintf(stderr, "runner: could not read baseline \"%s\".\n", baselinePath);
+        return 1;
+    }
+
+    printf("%-10s %10s %16s %10s", "benchmark", "median s", "instructions", "peak KB");
+    if (baseline != NULL)
+        printf(" %10s %10s %10s", "time", "instr", "rss");
+    printf("\n");
+
+    Result results[BENCHMARK_COUNT];
+    bool failed = false;
+    int regressions = 0;
+    for (int i = 0; i < BENCHMARK_COUNT; i++)
+    {
+        const char *script = benchmarks[i].path != NULL ? benchmarks[i].path : compilePath;
+        Result *result = &results[i];
+        if (!runBenchmark(npa, script, benchmarks[i].option, runs, result))
+        {
+            failed = true;
+            memset(result, 0, sizeof(*result));
+            continue;
+        }
+
+        printf("%-10s %10.4f", benchmarks[i].name, result->seconds);
+        if (result->instructions > 0)
+            printf(" %16llu", (unsigned long long)result->instructions);
+        else
+            printf(" %16s", "-");
+        printf(" %10ld", result->rssKb);
+
+        Result before;
+        if (baseline != NULL && findBaseline(baseline, benchmarks[i].name, &before))
+        {
+            bool regressed = compareMetric(result->seconds, before.seconds, threshold);
+            regressed |= compareMetric((double)result->instructions, (double)before.instructions, threshold);
+            regressed |= compareMetric((double)result->rssKb, (double)before.rssKb, threshold);
+            if (regressed)
+            {
+                printf("  REGRESSION");
+                regressions++;
+            }
+        }
+        printf("\n");
+    }
+    unlink(compilePath);
+    free(baseline);
+
+    if (savePath != NULL && !failed && !saveResults(savePath, results))
+    {
+        fprintf(stderr, "runner: could not write \"%s\".\n", savePath);
+        return 1;
+    }
+    if (regressions > 0)
+        printf("%d benchmark(s) regressed by more than %.1f%%.\n", regressions, threshold);
+    return failed || regressions > 0 ? 1 : 0;
+}
@@ -0,0 +1,486 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define CACHE_MMAP
+#endif
+
+#include "cache.h"
+#include "hash.h"
+#include "memory.h"
+#include "table.h"
+#include "verifier.h"
+#include "vm.h"
+
+// File layout. Integers are written in the compiling machine's byte order, which the header records.
+//
+//   header     "NPAC", u32 version, u32 byte-order mark, u64 source hash, u32 source length, u64 payload hash
+//   strings    u32 count, then per string: u32 length, bytes
+//   globals    u32 count, then per slot: u32 string index of the global's name
+//   function   the script function, see writeFunction()
+//
+// Every string is stored once and referred to by index, so loading interns each of them once. The payload hash
+// covers everything after the header.
+
+#define CACHE_MAGIC "NPAC"
+#define BYTE_ORDER_MARK 0x01020304u
+
+typedef enum
+{
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+    CONSTANT_CLOSURE, // The shared closure of a function without upvalues; the function follows inline.
+} ConstantTag;
+
+#define HEADER_SIZE 32 // Where the payload starts; the payload hash is the header's last field.
+
+typedef struct
+{
+    FILE *file;
+    uint64_t hash;      // Of everything written since the header.
+    Table indexes;      // ObjString -> index in the string section.
+    ValueArray strings; // The strings in index order.
+} Writer;
+
+static void writeBytes(Writer *writer, const void *bytes, size_t size)
+{
+    fwrite(bytes, 1, size, writer->file);
+    writer->hash = hashBytes(writer->hash, bytes, size);
+}
+
+static void writeU8(Writer *writer, uint8_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU32(Writer *writer, uint32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU64(Writer *writer, uint64_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+// Assigns the next string index to a string the first time it's seen. Everything collected here is already
+// reachable from the function being written or from the global table, so the GC can run in between.
+static void collectString(Writer *writer, ObjString *string)
+{
+    Value index;
+    if (string == NULL || tableGet(&writer->indexes, string, &index))
+        return;
+
+    tableSet(&writer->indexes, string, NUMBER_VAL((double)writer->strings.count));
+    writeValueArray(&writer->strings, OBJ_VAL(string));
+}
+
+static void collectStrings(Writer *writer, ObjFunction *function)
+{
+    collectString(writer, function->name);
+    for (int i = 0; i < function->chunk.constants.count; i++)
+    {
+        Value constant = function->chunk.constants.values[i];
+        if (IS_STRING(constant))
+            collectString(writer, AS_STRING(constant));
+        else if (IS_FUNCTION(constant))
+            collectStrings(writer, AS_FUNCTION(constant));
+        else if (IS_CLOSURE(constant))
+            collectStrings(writer, AS_CLOSURE(constant)->function);
+    }
+}
+
+static uint32_t stringIndex(Writer *writer, ObjString *string)
+{
+    Value index;
+    tableGet(&writer->indexes, string, &index);
+    return (uint32_t)AS_NUMBER(index);
+}
+
+// i32 arity, i32 upvalue count, i32 name (string index or -1), i32 byte count, code, u32 line run count, the
+// runs as the chunk's LineStart array, u32 constant count, then per constant a tag byte followed by its payload.
+static void writeFunction(Writer *writer, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    writeU32(writer, (uint32_t)function->arity);
+    writeU32(writer, (uint32_t)function->upvalueCount);
+    writeU32(writer, function->name == NULL ? UINT32_MAX : stringIndex(writer, function->name));
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, (size_t)chunk->count);
+    writeU32(writer, (uint32_t)chunk->lineCount);
+    writeBytes(writer, chunk->lines, (size_t)chunk->lineCount * sizeof(LineStart));
+
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_NIL(constant))
+        {
+            writeU8(writer, CONSTANT_NIL);
+        }
+        else if (IS_BOOL(constant))
+        {
+            writeU8(writer, AS_BOOL(constant) ? CONSTANT_TRUE : CONSTANT_FALSE);
+        }
+        else if (IS_NUMBER(constant))
+        {
+            double number = AS_NUMBER(constant);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeU8(writer, CONSTANT_NUMBER);
+            writeU64(writer, bits);
+        }
+        else if (IS_STRING(constant))
+        {
+            writeU8(writer, CONSTANT_STRING);
+            writeU32(writer, stringIndex(writer, AS_STRING(constant)));
+        }
+        else if (IS_CLOSURE(constant))
+        {
+            writeU8(writer, CONSTANT_CLOSURE);
+            writeFunction(writer, AS_CLOSURE(constant)->function);
+        }
+        else
+        {
+            writeU8(writer, CONSTANT_FUNCTION);
+            writeFunction(writer, AS_FUNCTION(constant));
+        }
+    }
+}
+
+// Writes a freshly compiled script function to path. The file is written under a temporary name and renamed
+// into place, so a concurrent run never sees half of it. The caller keeps the function reachable.
+bool writeBytecodeCache(ObjFunction *function, const char *source, const char *path)
+{
+    size_t pathLength = strlen(path);
+    char *temporary = malloc(pathLength + 5);
+    memcpy(temporary, path, pathLength);
+    memcpy(temporary + pathLength, ".tmp", 5);
+
+    Writer writer;
+    writer.file = fopen(temporary, "wb");
+    if (writer.file == NULL)
+    {
+        free(temporary);
+        return false;
+    }
+    writer.hash = HASH_SEED;
+    initTable(&writer.indexes);
+    initValueArray(&writer.strings);
+
+    for (int i = 0; i < vm.globalNames.count; i++)
+        collectString(&writer, AS_STRING(vm.globalNames.values[i]));
+    collectStrings(&writer, function);
+
+    // The payload hash is only known at the end, so the header is written with a placeholder and patched.
+    size_t sourceLength = strlen(source);
+    writeBytes(&writer, CACHE_MAGIC, 4);
+    writeU32(&writer, CACHE_VERSION);
+    writeU32(&writer, BYTE_ORDER_MARK);
+    writeU64(&writer, hashBytes(HASH_SEED, source, sourceLength));
+    writeU32(&writer, (uint32_t)sourceLength);
+    writeU64(&writer, 0);
+    writer.hash = HASH_SEED;
+
+    writeU32(&writer, (uint32_t)writer.strings.count);
+    for (int i = 0; i < writer.strings.count; i++)
+    {
+        ObjString *string = AS_STRING(writer.strings.values[i]);
+        writeU32(&writer, (uint32_t)string->length);
+        writeBytes(&writer, string->chars, (size_t)string->length);
+    }
+
+    writeU32(&writer, (uint32_t)vm.globalNames.count);
+    for (int i = 0; i < vm.globalNames.count; i++)
+        writeU32(&writer, stringIndex(&writer, AS_STRING(vm.globalNames.values[i])));
+
+    writeFunction(&writer, function);
+    fseek(writer.file, HEADER_SIZE - sizeof(uint64_t), SEEK_SET);
+    fwrite(&writer.hash, sizeof(writer.hash), 1, writer.file);
+
+    bool written = !ferror(writer.file);
+    written &= fclose(writer.file) == 0;
+    written = written && rename(temporary, path) == 0;
+    if (!written)
+        remove(temporary);
+
+    freeTable(&writer.indexes);
+    freeValueArray(&writer.strings);
+    free(temporary);
+    return written;
+}
+
+// A bounds-checked cursor over the mapped file. Reads past the end return zero and mark the cache invalid.
+typedef struct
+{
+    const uint8_t *current;
+    const uint8_t *end;
+    bool failed;
+    ObjFunction *strings; // Holds the interned strings as its constants, which keeps them rooted.
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < size)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->current;
+    reader->current += size;
+    return bytes;
+}
+
+static uint32_t readU32(Reader *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t readU64(Reader *reader)
+{
+    uint64_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static ObjString *stringAt(Reader *reader, uint32_t index)
+{
+    if (reader->failed || index >= (uint32_t)reader->strings->chunk.constants.count)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    return AS_STRING(reader->strings->chunk.constants.values[index]);
+}
+
+static ObjString *readString(Reader *reader)
+{
+    return stringAt(reader, readU32(reader));
+}
+
+// Rebuilds one function. Code and line numbers are single copies out of the mapping; run() rewrites code in
+// place when it quickens instructions, so it can't point into the file.
+static ObjFunction *readFunction(Reader *reader, int depth)
+{
+    if (depth > UINT8_COUNT)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    ObjFunction *function = newFunction();
+    push(OBJ_VAL(function));
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    uint32_t name = readU32(reader);
+    if (name != UINT32_MAX)
+        function->name = stringAt(reader, name);
+
+    uint32_t count = readU32(reader);
+    const uint8_t *code = readBytes(reader, count);
+    uint32_t lineCount = readU32(reader);
+    const uint8_t *lines = readBytes(reader, (size_t)lineCount * sizeof(LineStart));
+    // The script function is called without arguments or upvalues.
+    bool badScript = depth == 0 && (function->arity != 0 || function->upvalueCount != 0);
+    if (reader->failed || badScript || count == 0 || count > INT32_MAX || lineCount == 0 || lineCount > count)
+    {
+        reader->failed = true;
+        pop();
+        return NULL;
+    }
+
+    Chunk *chunk = &function->chunk;
+    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    chunk->capacity = (int)count;
+    chunk->count = (int)count;
+    memcpy(chunk->code, code, count);
+    chunk->lines = GROW_ARRAY(LineStart, NULL, 0, lineCount);
+    chunk->lineCapacity = (int)lineCount;
+    chunk->lineCount = (int)lineCount;
+    memcpy(chunk->lines, lines, (size_t)lineCount * sizeof(LineStart));
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++)
+    {
+        const uint8_t *tag = readBytes(reader, 1);
+        if (tag == NULL)
+            break;
+
+        switch (*tag)
+        {
+        case CONSTANT_NIL:
+            writeValueArray(&chunk->constants, NIL_VAL);
+            break;
+        case CONSTANT_FALSE:
+            writeValueArray(&chunk->constants, BOOL_VAL(false));
+            break;
+        case CONSTANT_TRUE:
+            writeValueArray(&chunk->constants, BOOL_VAL(true));
+            break;
+        case CONSTANT_NUMBER:
+        {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            writeValueArray(&chunk->constants, NUMBER_VAL(number));
+            break;
+        }
+        case CONSTANT_STRING:
+        {
+            ObjString *string = readString(reader);
+            if (string != NULL)
+                writeValueArray(&chunk->constants, OBJ_VAL(string));
+            break;
+        }
+        case CONSTANT_FUNCTION:
+        {
+            ObjFunction *nested = readFunction(reader, depth + 1);
+            if (nested != NULL)
+            {
+                push(OBJ_VAL(nested));
+                writeValueArray(&chunk->constants, OBJ_VAL(nested));
+                pop();
+            }
+            break;
+        }
+        case CONSTANT_CLOSURE:
+        {
+            ObjFunction *nested = readFunction(reader, depth + 1);
+            if (nested != NULL && nested->upvalueCount != 0)
+            {
+                reader->failed = true;
+            }
+            else if (nested != NULL)
+            {
+                push(OBJ_VAL(nested));
+                push(OBJ_VAL(newClosure(nested)));
+                writeValueArray(&chunk->constants, vm.stackTop[-1]);
+                pop();
+                pop();
+            }
+            break;
+        }
+        default:
+            reader->failed = true;
+            break;
+        }
+    }
+
+    // The script function has no caller.
+    if (!reader->failed && (!verifyFunction(function) || (depth == 0 && callerLocalsNeeded(function) > 0)))
+        reader->failed = true;
+
+    pop();
+    return reader->failed ? NULL : function;
+}
+
+// Checks the header and the global slot table, then rebuilds the function tree.
+static ObjFunction *readCache(Reader *reader, const char *source)
+{
+    size_t sourceLength = strlen(source);
+    const uint8_t *magic = readBytes(reader, 4);
+    if (magic == NULL || memcmp(magic, CACHE_MAGIC, 4) != 0)
+        return NULL;
+    if (readU32(reader) != CACHE_VERSION || readU32(reader) != BYTE_ORDER_MARK)
+        return NULL;
+    if (readU64(reader) != hashBytes(HASH_SEED, source, sourceLength) || readU32(reader) != (uint32_t)sourceLength)
+        return NULL;
+    uint64_t payloadHash = readU64(reader);
+    if (reader->failed || hashBytes(HASH_SEED, reader->current, reader->end - reader->current) != payloadHash)
+        return NULL;
+
+    reader->strings = newFunction();
+    push(OBJ_VAL(reader->strings));
+    uint32_t stringCount = readU32(reader);
+    for (uint32_t i = 0; i < stringCount && !reader->failed; i++)
+    {
+        uint32_t length = readU32(reader);
+        const uint8_t *chars = readBytes(reader, length);
+        if (chars == NULL || length > INT32_MAX)
+            break;
+
+        push(OBJ_VAL(copyString((const char *)chars, (int)length)));
+        writeValueArray(&reader->strings->chunk.constants, vm.stackTop[-1]);
+        pop();
+    }
+
+    // Instructions address globals by slot, so the names have to land in the same slots they had when the
+    // file was written. That holds for a fresh VM with the same natives; anything else means recompiling.
+    uint32_t globalCount = readU32(reader);
+    for (uint32_t i = 0; i < globalCount && !reader->failed; i++)
+    {
+        ObjString *name = readString(reader);
+        if (name != NULL && globalSlot(name) != (int)i)
+            reader->failed = true;
+    }
+
+    ObjFunction *function = reader->failed ? NULL : readFunction(reader, 0);
+    pop();
+    return function;
+}
+
+// Loads the compiled form of source from path. Returns NULL when there's no usable cache: the file is
+// missing, written by another version or byte order, compiled from different source, or damaged.
+ObjFunction *loadBytecodeCache(const char *source, const char *path)
+{
+    Reader reader;
+    reader.failed = false;
+    reader.strings = NULL;
+
+#ifdef CACHE_MMAP
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t)info.st_size;
+    void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED)
+        return NULL;
+
+    reader.current = mapping;
+    reader.end = reader.current + size;
+    ObjFunction *function = readCache(&reader, source);
+    munmap(mapping, size);
+#else
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    uint8_t *buffer = malloc(size > 0 ? size : 1);
+    size_t bytesRead = buffer != NULL ? fread(buffer, 1, size, file) : 0;
+    fclose(file);
+
+    reader.current = buffer;
+    reader.end = buffer + bytesRead;
+    ObjFunction *function = buffer != NULL ? readCache(&reader, source) : NULL;
+    free(buffer);
+#endif
+
+    return function;
+}
@@ -0,0 +1,16 @@
+#ifndef npa_cache_h
+#define npa_cache_h
+
+#include "common.h"
+#include "object.h"
+
+// Bytecode cache files. A cache holds a script's compiled function tree together with the hash of the source it
+// was compiled from and the global slot table its instructions refer to; a cache that doesn't match the
+// source or the running VM is ignored and the script is compiled as usual.
+
+#define CACHE_VERSION 4 // Bump whenever the opcode set or the file layout changes.
+
+bool writeBytecodeCache(ObjFunction *function, const char *source, const char *path);
+ObjFunction *loadBytecodeCache(const char *source, const char *path);
+
+#endif
@@ -10,10 +10,57 @@ void initChunk(Chunk *chunk)
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
 }
 
+// Function to record that the bytes from offset on were compiled from line. Offsets must not go backwards,
+// except that runs starting at or after offset are dropped first, since the compiler can cut code back
+// (constant folding) and write over it.
+void addLine(Chunk *chunk, int offset, int line)
+{
+    while (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].offset >= offset)
+        chunk->lineCount--;
+    if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line)
+        return;
+
+    if (chunk->lineCapacity < chunk->lineCount + 1)
+    {
+        int oldCapacity = chunk->lineCapacity;
+        chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(LineStart, chunk->lines, oldCapacity, chunk->lineCapacity);
+    }
+
+    LineStart *start = &chunk->lines[chunk->lineCount++];
+    start->offset = offset;
+    start->line = line;
+}
+
+// Function to find the source line of the byte at offset, by binary search for the last run starting at or
+// before it.
+int getLine(Chunk *chunk, int offset)
+{
+    int low = 0;
+    int high = chunk->lineCount - 1;
+    int line = 0;
+    while (low <= high)
+    {
+        int middle = low + (high - low) / 2;
+        if (chunk->lines[middle].offset <= offset)
+        {
+            line = chunk->lines[middle].line;
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    return line;
+}
+
 // Function to write a byte to a chunk of memory. If the chunk's capacity is insufficient, it increases the capacity.
 void writeChunk(Chunk *chunk, uint8_t byte, int line)
 {
@@ -22,11 +69,10 @@ void writeChunk(Chunk *chunk, uint8_t byte, int line)
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
+    addLine(chunk, chunk->count, line);
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
 }
 
@@ -39,11 +85,130 @@ int addConstant(Chunk *chunk, Value value)
     return chunk->constants.count - 1;
 }
 
+// Function to get the size in bytes of the instruction at offset, operands included.
+int instructionLength(Chunk *chunk, int offset)
+{
+    return opcodeLength(chunk, chunk->code[offset], offset);
+}
+
+// Function to get the size in bytes of an instruction at offset if its opcode were the given one. Used to
+// step through the original instructions hidden behind a superinstruction.
+int opcodeLength(Chunk *chunk, uint8_t instruction, int offset)
+{
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CALLER_LOCAL:
+    case OP_SET_CALLER_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return 2;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+        return 3;
+    case OP_CALL_NATIVE:
+        return 4;
+    case OP_CLOSURE:
+    {
+        ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+        return 2 + function->upvalueCount * 2;
+    }
+    case OP_SET_LOCAL_POP:
+        return 3;
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_SET_GLOBAL_POP:
+        return 4;
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+        return 5;
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+        return 9;
+    default:
+        return 1;
+    }
+}
+
+// Function to get how many values an instruction at offset takes off the stack and how many it leaves there, if
+// its opcode were the given one. OP_JUMP_IF_FALSE only looks at its condition, so it takes one and leaves it.
+// Superinstructions aren't covered; step through the instructions they hide instead.
+void stackEffect(Chunk *chunk, uint8_t instruction, int offset, int *popped, int *pushed)
+{
+    uint8_t *operands = &chunk->code[offset + 1];
+    *popped = 0;
+    *pushed = 0;
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_GET_CALLER_LOCAL:
+    case OP_CLOSURE:
+        *pushed = 1;
+        break;
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+    case OP_SET_UPVALUE:
+    case OP_SET_CALLER_LOCAL:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_JUMP_IF_FALSE:
+        *popped = 1;
+        *pushed = 1;
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+        *popped = 1;
+        break;
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+        *popped = 2;
+        *pushed = 1;
+        break;
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        *popped = operands[0] + 1;
+        *pushed = 1;
+        break;
+    case OP_CALL_NATIVE:
+        *popped = operands[2];
+        *pushed = 1;
+        break;
+    default:
+        break;
+    }
+}
+
 // Function to free the memory allocated to a chunk.
 void freeChunk(Chunk *chunk)
 {
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    FREE_ARRAY(LineStart, chunk->lines, chunk->lineCapacity);
     freeValueArray(&chunk->constants);
     initChunk(chunk);
 }
\ No newline at end of file
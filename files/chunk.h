@@ -19,9 +19,14 @@ typedef enum
     OP_SET_GLOBAL,
     OP_GET_UPVALUE,
     OP_SET_UPVALUE,
+    OP_GET_CALLER_LOCAL, // A local of the calling frame. Replaces upvalue access in closures that never leave the
+    OP_SET_CALLER_LOCAL, // function defining them, which is then always the caller (see optimizer.c).
     OP_EQUAL,
     OP_GREATER,
     OP_LESS,
+    OP_NOT_EQUAL,     // OP_EQUAL, OP_NOT
+    OP_GREATER_EQUAL, // OP_LESS, OP_NOT. Computed as !(a < b), so it is true when either side is NaN.
+    OP_LESS_EQUAL,    // OP_GREATER, OP_NOT. Computed as !(a > b).
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
@@ -33,24 +38,57 @@ typedef enum
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,   // OP_CALL whose result is returned straight away; reuses the caller's frame.
+    OP_CALL_NATIVE, // Call of the native in a global slot (16 bits), then argument count. No callee on the stack.
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
+
+    // Superinstructions. The optimizer writes one of these over the first opcode of a common sequence and
+    // leaves the rest of the sequence's bytes in place, so jump offsets stay valid and the handler can fall
+    // back to running the original instructions.
+    OP_ADD_LOCALS,               // OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD
+    OP_ADD_LOCAL_CONSTANT,       // OP_GET_LOCAL, OP_CONSTANT, OP_ADD
+    OP_LESS_LOCAL_CONSTANT_JUMP, // OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP
+    OP_JUMP_IF_FALSE_POP,        // OP_JUMP_IF_FALSE, OP_POP
+    OP_SET_LOCAL_POP,            // OP_SET_LOCAL, OP_POP
+    OP_SET_GLOBAL_POP,           // OP_SET_GLOBAL, OP_POP
+
+    // Quickened forms. The compiler never emits these: run() rewrites a generic instruction into one of them
+    // in place once it has seen the operand types, and rewrites it back if the guess stops holding.
+    OP_ADD_NUM,   // OP_ADD on two numbers.
+    OP_ADD_STR,   // OP_ADD on two strings.
+    OP_EQUAL_NUM, // OP_EQUAL on two numbers.
 } OpCode;
 
-// This is a struct that represents a chunk of memory.
+// The start of a run of bytecode compiled from one source line. The run lasts until the next one starts.
+typedef struct
+{
+    int offset;
+    int line;
+} LineStart;
+
+// This is a struct that represents a chunk of memory. Line numbers are only needed for errors and debugging,
+// so they're kept run-length encoded in their own array rather than one per byte next to the code.
 typedef struct
 {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
     ValueArray constants;
+    int lineCount;
+    int lineCapacity;
+    LineStart *lines;
 } Chunk;
 
 void initChunk(Chunk *chunk);
 void freeChunk(Chunk *chunk);
 void writeChunk(Chunk *chunk, uint8_t byte, int line);
+void addLine(Chunk *chunk, int offset, int line);
+int getLine(Chunk *chunk, int offset);
 int addConstant(Chunk *chunk, Value value);
+int instructionLength(Chunk *chunk, int offset);
+int opcodeLength(Chunk *chunk, uint8_t instruction, int offset);
+void stackEffect(Chunk *chunk, uint8_t instruction, int offset, int *popped, int *pushed);
 
 #endif
\ No newline at end of file
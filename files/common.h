@@ -8,13 +8,58 @@
 #include <stdint.h>  // Provides exact-width integer types.
 
 // These are debug flags. They control whether certain debug information is printed.
+// Building with -DNDEBUG turns them off, which is what release and benchmark builds should use.
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE      // If defined, the code will be printed for debugging.
 #define DEBUG_TRACE_EXECUTION // If defined, the execution of the code will be traced for debugging.
+#endif
 
 // These are commented out debug flags. They could be used to enable additional debugging features.
 // #define DEBUG_BYTECODE     // If defined, the bytecode will be printed for debugging.
 // #define DEBUG_STRESS_GC   // If defined, the garbage collector will be stressed for debugging.
 // #define DEBUG_LOG_GC      // If defined, the garbage collector will be logged for debugging.
+// #define DEBUG_COUNT_OPCODES // If defined, run() counts opcodes, opcode pairs, instructions per function and
+                               // table probes, and freeVM() writes them out as JSON (see debug.c).
+
+// Threaded dispatch. run() jumps straight from one opcode handler to the next through a table of label
+// addresses (the GNU "labels as values" extension). Build with -DNO_COMPUTED_GOTO to get the portable switch.
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(NO_COMPUTED_GOTO)
+#define COMPUTED_GOTO
+#endif
+
+// NaN boxing. Values are packed into a single 64-bit word instead of a 16-byte tagged union, which halves
+// the VM stack, constant pools and table entries. It needs 64-bit pointers; build with -DNO_NAN_BOXING to
+// get the tagged union back.
+#if UINTPTR_MAX == UINT64_MAX && !defined(NO_NAN_BOXING)
+#define NAN_BOXING
+#endif
+
+// Baseline JIT (jit.c). It emits x86-64 machine code and relies on NaN-boxed values and mmap, so it is only
+// built where all three are available; build with -DNO_JIT to leave it out. It still only runs with --jit.
+#if defined(__x86_64__) && defined(NAN_BOXING) && (defined(__linux__) || defined(__APPLE__)) && !defined(NO_JIT)
+#define BASELINE_JIT
+#endif
+
+// Sampling profiler (profiler.c). A SIGPROF interval timer samples the call stack, so it needs POSIX signals;
+// build with -DNO_PROFILER to leave it out. It only runs with --profile.
+#if (defined(__unix__) || defined(__APPLE__)) && !defined(NO_PROFILER)
+#define SAMPLING_PROFILER
+#endif
+
+// Concurrent marking (memory.c). A background thread marks the old generation while run() carries on. It needs
+// POSIX threads and NaN-boxed values, which the marker can load in a single atomic access; build with
+// -DNO_CONCURRENT_GC to leave it out. It only runs with --gc-concurrent. The order in which the hardware makes
+// stores visible isn't relied on: the references the marker follows are written with release stores and read
+// with acquire loads (see STORE_REFERENCE() in memory.h).
+#if defined(NAN_BOXING) && (defined(__linux__) || defined(__APPLE__)) && !defined(NO_CONCURRENT_GC)
+#define CONCURRENT_GC
+#endif
+
+// SSE2 group probing in the hash tables (table.c), which compares 16 control bytes per instruction. Every x86-64
+// compiler targets SSE2; elsewhere, or with -DNO_SIMD_TABLE, a portable loop does the same job.
+#if defined(__SSE2__) && !defined(NO_SIMD_TABLE)
+#define SIMD_TABLE
+#endif
 
 // This is a constant that represents the number of possible values of a uint8_t.
 #define UINT8_COUNT (UINT8_MAX + 1)
@@ -5,6 +5,7 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimizer.h"
 #include "scanner.h"
 
 #ifdef DEBUG_PRINT_CODE
@@ -39,7 +40,7 @@ typedef enum
 
 // This is a function pointer type. It represents a function that parses a prefix expression.
 typedef void (*ParseFn)(bool canAssign);
-static uint8_t identifierConstant(Token *name);
+static uint16_t resolveGlobal(Token *name);
 static void call(bool canAssign);
 static uint8_t argumentList();
 
@@ -82,6 +83,12 @@ typedef struct Compiler
     int localCount;
     Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    int lastCall; // Offset of the most recent OP_CALL, so returnStatement() can spot a call in tail position.
+
+    // The constant load the code emitted so far ends with, if any: its offset, and how many entries the
+    // constant pool had before it. binary() and unary() fold their operator into operands found here.
+    int constantStart;
+    int constantPoolCount;
 } Compiler;
 
 Parser parser;
@@ -168,6 +175,7 @@ static bool match(TokenType type)
 static void emitByte(uint8_t byte)
 {
     writeChunk(currentChunk(), byte, parser.previous.line);
+    current->constantStart = -1;
 }
 
 static void emitBytes(uint8_t byte1, uint8_t byte2)
@@ -176,6 +184,12 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+static void emitShort(uint16_t value)
+{
+    emitByte((value >> 8) & 0xff);
+    emitByte(value & 0xff);
+}
+
 static void emitLoop(int loopStart)
 {
     emitByte(OP_LOOP);
@@ -202,9 +216,32 @@ static void emitReturn()
     emitByte(OP_RETURN);
 }
 
+// Constants are shared between loads of the same value. Numbers are compared bit for bit, which keeps 0 and -0
+// apart and NaNs from matching anything; strings are interned, so comparing pointers is enough.
+static int findConstant(ValueArray *constants, Value value)
+{
+    for (int i = 0; i < constants->count; i++)
+    {
+        Value constant = constants->values[i];
+        if (IS_NUMBER(value) && IS_NUMBER(constant))
+        {
+            double a = AS_NUMBER(value), b = AS_NUMBER(constant);
+            if (memcmp(&a, &b, sizeof(double)) == 0)
+                return i;
+        }
+        else if (!IS_NUMBER(value) && !IS_NUMBER(constant) && valuesEqual(value, constant))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 static uint8_t makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    int constant = findConstant(&currentChunk()->constants, value);
+    if (constant == -1)
+        constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX)
     {
         error("Too many constants in one chunk.");
@@ -216,7 +253,54 @@ static uint8_t makeConstant(Value value)
 
 static void emitConstant(Value value)
 {
+    int start = currentChunk()->count;
+    int poolCount = currentChunk()->constants.count;
     emitBytes(OP_CONSTANT, makeConstant(value));
+    current->constantStart = start;
+    current->constantPoolCount = poolCount;
+}
+
+// Emits a load of any constant value, using the dedicated opcodes for nil and the booleans.
+static void emitValue(Value value)
+{
+    int start = currentChunk()->count;
+    int poolCount = currentChunk()->constants.count;
+    if (IS_NIL(value))
+        emitByte(OP_NIL);
+    else if (IS_BOOL(value))
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else
+        emitConstant(value);
+    current->constantStart = start;
+    current->constantPoolCount = poolCount;
+}
+
+// Reads the value loaded by the constant load at offset.
+static Value loadedValue(int offset)
+{
+    Chunk *chunk = currentChunk();
+    switch (chunk->code[offset])
+    {
+    case OP_NIL:
+        return NIL_VAL;
+    case OP_TRUE:
+        return BOOL_VAL(true);
+    case OP_FALSE:
+        return BOOL_VAL(false);
+    default:
+        return chunk->constants.values[chunk->code[offset + 1]];
+    }
+}
+
+// Replaces everything from the constant load at start onwards with a load of value. Constants added since
+// that load are dropped first: nothing else has been emitted in between, so nothing else refers to them.
+static void replaceWithConstant(int start, int poolCount, Value value)
+{
+    push(value); // The value may be a new string that nothing else refers to yet.
+    currentChunk()->count = start;
+    currentChunk()->constants.count = poolCount;
+    emitValue(value);
+    pop();
 }
 
 static void patchJump(int offset)
@@ -232,6 +316,9 @@ static void patchJump(int offset)
 
     currentChunk()->code[offset] = (jump >> 8) & 0xff;
     currentChunk()->code[offset + 1] = jump & 0xff;
+
+    // The code so far now ends at a jump target, so it can't be folded into what follows.
+    current->constantStart = -1;
 }
 
 // The main functions for parsing and compiling different language constructs like expressions, statements, and declarations.
@@ -244,6 +331,9 @@ static void initCompiler(Compiler *compiler, FunctionType type)
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
+    compiler->lastCall = -1;
+    compiler->constantStart = -1;
+    compiler->constantPoolCount = 0;
     compiler->function = newFunction();
     current = compiler;
     if (type != TYPE_SCRIPT)
@@ -262,6 +352,11 @@ static ObjFunction *endCompiler()
 {
     emitReturn();
     ObjFunction *function = current->function;
+    if (!parser.hadError)
+    {
+        optimizeChunk(function);
+        fuseSuperinstructions(currentChunk());
+    }
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
     {
@@ -305,52 +400,134 @@ static void and_(bool canAssign);
 static int resolveLocal(Compiler *compiler, Token *name);
 static int resolveUpvalue(Compiler *compiler, Token *name);
 
+static bool isFalsey(Value value)
+{
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// Computes what one arithmetic or comparison opcode would leave on the stack for two constants. Returns false
+// where run() would report a type error, so the error still happens at runtime, on the right line.
+static bool foldOperation(uint8_t op, Value a, Value b, Value *result)
+{
+    if (op == OP_EQUAL)
+    {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+
+    if (op == OP_ADD && IS_STRING(a) && IS_STRING(b))
+    {
+        ObjString *left = AS_STRING(a);
+        ObjString *right = AS_STRING(b);
+        int length = left->length + right->length;
+        char *chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b))
+        return false;
+
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    switch (op)
+    {
+    case OP_GREATER:
+        *result = BOOL_VAL(x > y);
+        return true;
+    case OP_LESS:
+        *result = BOOL_VAL(x < y);
+        return true;
+    case OP_ADD:
+        *result = NUMBER_VAL(x + y);
+        return true;
+    case OP_SUBTRACT:
+        *result = NUMBER_VAL(x - y);
+        return true;
+    case OP_MULTIPLY:
+        *result = NUMBER_VAL(x * y);
+        return true;
+    case OP_DIVIDE:
+        *result = NUMBER_VAL(x / y);
+        return true;
+    default:
+        return false;
+    }
+}
+
 static void binary(bool canAssign)
 {
     TokenType operatorType = parser.previous.type;
     ParseRule *rule = getRule(operatorType);
+
+    // If the left operand is a single constant load, it sits right before the right operand.
+    int leftStart = current->constantStart;
+    int leftPoolCount = current->constantPoolCount;
+    int rightStart = currentChunk()->count;
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    uint8_t op;
+    bool negate = false; // != and the >= and <= forms are the opposite comparison followed by OP_NOT.
     switch (operatorType)
     {
     case TOKEN_BANG_EQUAL:
-        emitBytes(OP_EQUAL, OP_NOT);
+        op = OP_EQUAL;
+        negate = true;
         break;
     case TOKEN_EQUAL_EQUAL:
-        emitByte(OP_EQUAL);
+        op = OP_EQUAL;
         break;
     case TOKEN_GREATER:
-        emitByte(OP_GREATER);
+        op = OP_GREATER;
         break;
     case TOKEN_GREATER_EQUAL:
-        emitBytes(OP_LESS, OP_NOT);
+        op = OP_LESS;
+        negate = true;
         break;
     case TOKEN_LESS:
-        emitByte(OP_LESS);
+        op = OP_LESS;
         break;
     case TOKEN_LESS_EQUAL:
-        emitBytes(OP_GREATER, OP_NOT);
+        op = OP_GREATER;
+        negate = true;
         break;
     case TOKEN_PLUS:
-        emitByte(OP_ADD);
+        op = OP_ADD;
         break;
     case TOKEN_MINUS:
-        emitByte(OP_SUBTRACT);
+        op = OP_SUBTRACT;
         break;
     case TOKEN_STAR:
-        emitByte(OP_MULTIPLY);
+        op = OP_MULTIPLY;
         break;
     case TOKEN_SLASH:
-        emitByte(OP_DIVIDE);
+        op = OP_DIVIDE;
         break;
     default:
         return; // di ni maabot
     }
+
+    // Both operands are literal constants with nothing in between, so the result can be loaded instead. An
+    // operand with a side effect never ends in a bare constant load, so nothing observable is folded away.
+    Value result;
+    if (leftStart != -1 && current->constantStart == rightStart &&
+        foldOperation(op, loadedValue(leftStart), loadedValue(rightStart), &result))
+    {
+        replaceWithConstant(leftStart, leftPoolCount, negate ? BOOL_VAL(isFalsey(result)) : result);
+        return;
+    }
+
+    emitByte(op);
+    if (negate)
+        emitByte(OP_NOT);
 }
 
 static void call(bool canAssign)
 {
     uint8_t argCount = argumentList();
+    current->lastCall = currentChunk()->count;
     emitBytes(OP_CALL, argCount);
 }
 
@@ -359,13 +536,13 @@ static void literal(bool canAssign)
     switch (parser.previous.type)
     {
     case TOKEN_FALSE:
-        emitByte(OP_FALSE);
+        emitValue(BOOL_VAL(false));
         break;
     case TOKEN_NIL:
-        emitByte(OP_NIL);
+        emitValue(NIL_VAL);
         break;
     case TOKEN_TRUE:
-        emitByte(OP_TRUE);
+        emitValue(BOOL_VAL(true));
         break;
     default:
         return; // never maabot
@@ -405,6 +582,7 @@ static void namedVariable(Token name, bool canAssign)
 {
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
+    bool isGlobal = false;
 
     if (arg != -1)
     {
@@ -418,19 +596,41 @@ static void namedVariable(Token name, bool canAssign)
     }
     else
     {
-        arg = identifierConstant(&name);
+        arg = resolveGlobal(&name);
+
+        // Natives are defined before any script is compiled, so a call of a global that holds one can go
+        // straight to it. OP_CALL_NATIVE still checks the global when it runs in case it has been replaced.
+        if (check(TOKEN_LEFT_PAREN) && IS_NATIVE(vm.globalValues.values[arg]))
+        {
+            advance();
+            uint8_t argCount = argumentList();
+            emitByte(OP_CALL_NATIVE);
+            emitShort((uint16_t)arg);
+            emitByte(argCount);
+            return;
+        }
+
         getOp = OP_GET_GLOBAL;
         setOp = OP_SET_GLOBAL;
+        isGlobal = true;
     }
 
+    uint8_t op = getOp;
     if (canAssign && match(TOKEN_EQUAL))
     {
         expression();
-        emitBytes(setOp, (uint8_t)arg);
+        op = setOp;
+    }
+
+    // Global slots are 16 bits wide; locals and upvalues fit in a byte.
+    emitByte(op);
+    if (isGlobal)
+    {
+        emitShort((uint16_t)arg);
     }
     else
     {
-        emitBytes(getOp, (uint8_t)arg);
+        emitByte((uint8_t)arg);
     }
 }
 
@@ -442,10 +642,28 @@ static void variable(bool canAssign)
 static void unary(bool canAssign)
 {
     TokenType operatorType = parser.previous.type;
+    int operandStart = currentChunk()->count;
+    int operandPoolCount = currentChunk()->constants.count;
 
     // operand compile una
     parsePrecedence(PREC_UNARY);
 
+    // A literal operand is folded. ! works on any value; - only on numbers, so anything else still fails at runtime.
+    if (current->constantStart == operandStart)
+    {
+        Value operand = loadedValue(operandStart);
+        if (operatorType == TOKEN_BANG)
+        {
+            replaceWithConstant(operandStart, operandPoolCount, BOOL_VAL(isFalsey(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand))
+        {
+            replaceWithConstant(operandStart, operandPoolCount, NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
+
     // remove op instruction
     switch (operatorType)
     {
@@ -520,6 +738,7 @@ static void parsePrecedence(Precedence precedence)
         return;
     }
 
+    current->constantStart = -1; // Only a constant load emitted by this expression can be folded into it.
     bool canAssign = precedence <= PREC_ASSIGNMENT; // Check if assignment is allowed at the current precedence.
     prefixRule(canAssign);                          // Parse the prefix part of the expression.
 
@@ -538,9 +757,19 @@ static void parsePrecedence(Precedence precedence)
     }
 }
 
-static uint8_t identifierConstant(Token *name)
+// Resolves a global variable to its slot in vm.globalValues. The slot is reserved on first sight, so
+// functions can refer to globals that are only defined later; reading one before its definition runs
+// is still a runtime error.
+static uint16_t resolveGlobal(Token *name)
 {
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    int slot = globalSlot(copyString(name->start, name->length));
+    if (slot > UINT16_MAX)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token *a, Token *b)
@@ -651,13 +880,13 @@ static void declareVariable()
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char *errorMessage)
+static uint16_t parseVariable(const char *errorMessage)
 {
     consume(TOKEN_IDENTIFIER, errorMessage);
     declareVariable();
     if (current->scopeDepth > 0)
         return 0;
-    return identifierConstant(&parser.previous);
+    return resolveGlobal(&parser.previous);
 }
 
 static void markInitialized()
@@ -667,14 +896,15 @@ static void markInitialized()
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global)
+static void defineVariable(uint16_t global)
 {
     if (current->scopeDepth > 0)
     {
         markInitialized();
         return;
     }
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitByte(OP_DEFINE_GLOBAL);
+    emitShort(global);
 }
 
 static uint8_t argumentList()
@@ -742,7 +972,7 @@ static void function(FunctionType type)
             {
                 errorAtCurrent("Can't have more than 255 parameters.");
             }
-            uint8_t constant = parseVariable("Expected parameter name.");
+            uint16_t constant = parseVariable("Expected parameter name.");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));
     }
@@ -751,6 +981,20 @@ static void function(FunctionType type)
     block();
 
     ObjFunction *function = endCompiler();
+
+    // A function that captures nothing needs nothing from the frame that evaluates its declaration, so every
+    // evaluation can share one closure made here and loaded as a constant instead of allocated by OP_CLOSURE.
+    if (function->upvalueCount == 0)
+    {
+        push(OBJ_VAL(function));
+        Value closure = OBJ_VAL(newClosure(function));
+        push(closure);
+        emitBytes(OP_CONSTANT, makeConstant(closure));
+        pop();
+        pop();
+        return;
+    }
+
     emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
 
     for (int i = 0; i < function->upvalueCount; i++)
@@ -762,7 +1006,7 @@ static void function(FunctionType type)
 
 static void funDeclaration()
 {
-    uint8_t global = parseVariable("Expect function name. | Luke 1:37 \nFor no word from God will ever fail.”");
+    uint16_t global = parseVariable("Expect function name. | Luke 1:37 \nFor no word from God will ever fail.”");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -770,7 +1014,7 @@ static void funDeclaration()
 
 static void varDeclaration()
 {
-    uint8_t global = parseVariable("Expected variable name. | Luke 1:37 \nFor no word from God will ever fail.”");
+    uint16_t global = parseVariable("Expected variable name. | Luke 1:37 \nFor no word from God will ever fail.”");
 
     if (match(TOKEN_EQUAL))
     {
@@ -887,6 +1131,13 @@ static void returnStatement()
     {
         expression();
         consume(TOKEN_SEMICOLON, "Expected ';' after return value");
+
+        // A call that is the last thing the return value compiled to is in tail position. Jumps that skip it
+        // (`return a and f(x);`) land on the OP_RETURN, which still returns their value.
+        if (current->lastCall == currentChunk()->count - 2)
+        {
+            currentChunk()->code[current->lastCall] = OP_TAIL_CALL;
+        }
         emitByte(OP_RETURN);
     }
 }
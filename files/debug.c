@@ -1,8 +1,12 @@
 // Including standard I/O library and project-specific headers.
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "debug.h"
 #include "object.h"
+#include "optimizer.h"
 #include "value.h"
+#include "vm.h"
 
 // Disassembles a chunk of bytecode, printing its operations in a readable format.
 void disassembleChunk(Chunk *chunk, const char *name)
@@ -51,32 +55,211 @@ static int jumpInstruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;                                                   // Moves past the operation and jump offset in the bytecode.
 }
 
+// Handles the disassembly of global variable instructions, whose operand is a two-byte slot in vm.globalValues.
+static int globalInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]); // Prints the global's name.
+    printf("'\n");
+    return offset + 3;
+}
+
+// Handles the disassembly of OP_CALL_NATIVE: a global slot followed by an argument count.
+static int nativeCallInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '", name, slot);
+    printValue(vm.globalNames.values[slot]);
+    printf("' (%d args)\n", chunk->code[offset + 3]);
+    return offset + 4;
+}
+
+// Handles the disassembly of OP_CLOSURE, which is followed by a pair of bytes for each captured variable.
+static int closureInstruction(const char *name, Chunk *chunk, int offset)
+{
+    offset++;
+    uint8_t constant = chunk->code[offset++];
+    printf("%-16s %4d ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("\n");
+
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[constant]);
+    for (int j = 0; j < function->upvalueCount; j++)
+    {
+        int isLocal = chunk->code[offset++];
+        int index = chunk->code[offset++];
+        printf("%04d    |                     %s %d\n", offset - 2, isLocal ? "local" : "upvalue", index);
+    }
+
+    return offset;
+}
+
+// Handles the disassembly of superinstructions. Operands are read from where the original, unfused
+// sequence put them: local slots from GET_LOCAL bytes, constants from CONSTANT bytes, offsets from jumps.
+static int fusedInstruction(const char *name, Chunk *chunk, int offset)
+{
+    uint8_t *code = chunk->code + offset;
+    switch (code[0])
+    {
+    case OP_ADD_LOCALS:
+        printf("%-16s %4d %4d\n", name, code[1], code[3]);
+        return offset + 5;
+    case OP_ADD_LOCAL_CONSTANT:
+        printf("%-16s %4d %4d '", name, code[1], code[3]);
+        printValue(chunk->constants.values[code[3]]);
+        printf("'\n");
+        return offset + 5;
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    {
+        int jump = (code[6] << 8) | code[7];
+        printf("%-16s %4d %4d '", name, code[1], code[3]);
+        printValue(chunk->constants.values[code[3]]);
+        printf("' -> %d\n", offset + 8 + jump);
+        return offset + 9;
+    }
+    case OP_JUMP_IF_FALSE_POP:
+        return jumpInstruction(name, 1, chunk, offset) + 1; // Skips the fused OP_POP.
+    case OP_SET_LOCAL_POP:
+        return byteInstruction(name, chunk, offset) + 1;
+    case OP_SET_GLOBAL_POP:
+        return globalInstruction(name, chunk, offset) + 1;
+    default:
+        return offset + 1;
+    }
+}
+
+// Returns the printable name of an opcode.
+const char *opcodeName(uint8_t instruction)
+{
+    static const char *names[] = {
+        [OP_CONSTANT] = "OP_CONSTANT",
+        [OP_NIL] = "OP_NIL",
+        [OP_TRUE] = "OP_TRUE",
+        [OP_FALSE] = "OP_FALSE",
+        [OP_POP] = "OP_POP",
+        [OP_GET_LOCAL] = "OP_GET_LOCAL",
+        [OP_SET_LOCAL] = "OP_SET_LOCAL",
+        [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+        [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+        [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+        [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+        [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+        [OP_GET_CALLER_LOCAL] = "OP_GET_CALLER_LOCAL",
+        [OP_SET_CALLER_LOCAL] = "OP_SET_CALLER_LOCAL",
+        [OP_EQUAL] = "OP_EQUAL",
+        [OP_GREATER] = "OP_GREATER",
+        [OP_LESS] = "OP_LESS",
+        [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+        [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+        [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+        [OP_ADD] = "OP_ADD",
+        [OP_SUBTRACT] = "OP_SUBTRACT",
+        [OP_MULTIPLY] = "OP_MULTIPLY",
+        [OP_DIVIDE] = "OP_DIVIDE",
+        [OP_NOT] = "OP_NOT",
+        [OP_NEGATE] = "OP_NEGATE",
+        [OP_PRINT] = "OP_PRINT",
+        [OP_JUMP] = "OP_JUMP",
+        [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+        [OP_LOOP] = "OP_LOOP",
+        [OP_CALL] = "OP_CALL",
+        [OP_TAIL_CALL] = "OP_TAIL_CALL",
+        [OP_CALL_NATIVE] = "OP_CALL_NATIVE",
+        [OP_CLOSURE] = "OP_CLOSURE",
+        [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+        [OP_RETURN] = "OP_RETURN",
+        [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+        [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+        [OP_LESS_LOCAL_CONSTANT_JUMP] = "OP_LESS_LOCAL_CONSTANT_JUMP",
+        [OP_JUMP_IF_FALSE_POP] = "OP_JUMP_IF_FALSE_POP",
+        [OP_SET_LOCAL_POP] = "OP_SET_LOCAL_POP",
+        [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+        [OP_ADD_NUM] = "OP_ADD_NUM",
+        [OP_ADD_STR] = "OP_ADD_STR",
+        [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+    };
+
+    if (instruction >= sizeof(names) / sizeof(names[0]) || names[instruction] == NULL)
+        return "OP_UNKNOWN";
+    return names[instruction];
+}
+
 // Main function to disassemble an instruction at a given offset in a chunk.
 int disassembleInstruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset); // Prints the offset of the instruction in the bytecode.
 
     // Prints line numbers or a marker to indicate same line as previous instruction.
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1])
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset]; // Gets the instruction from the bytecode.
-    switch (instruction)                       // Dispatches based on the instruction type.
+    const char *name = opcodeName(instruction);
+    switch (instruction) // Dispatches based on the instruction type.
     {
-    // Handles different instruction types, calling appropriate functions.
-    // ...
+    case OP_CONSTANT:
+        return constantInstruction(name, chunk, offset);
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_POP:
+    case OP_EQUAL:
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_NOT_EQUAL:
+    case OP_GREATER_EQUAL:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_CLOSE_UPVALUE:
+    case OP_RETURN:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_EQUAL_NUM:
+        return simpleInstruction(name, offset);
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_GET_CALLER_LOCAL:
+    case OP_SET_CALLER_LOCAL:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+        return byteInstruction(name, chunk, offset);
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+        return globalInstruction(name, chunk, offset);
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+        return jumpInstruction(name, 1, chunk, offset);
+    case OP_LOOP:
+        return jumpInstruction(name, -1, chunk, offset);
+    case OP_CALL_NATIVE:
+        return nativeCallInstruction(name, chunk, offset);
     case OP_CLOSURE:
-    {
         // Special handling for OP_CLOSURE, which includes function and upvalues details.
-        // ...
-    }
-    // ... (handling other instructions)
+        return closureInstruction(name, chunk, offset);
+    case OP_ADD_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT_JUMP:
+    case OP_JUMP_IF_FALSE_POP:
+    case OP_SET_LOCAL_POP:
+    case OP_SET_GLOBAL_POP:
+        return fusedInstruction(name, chunk, offset);
     default:
         printf("Unknown opcode %d\n", instruction); // Handles unknown opcodes.
         return offset + 1;
@@ -93,8 +276,195 @@ void printBytecode(Chunk *chunk)
         // Prints line numbers at specific intervals or at the end of the chunk.
         if ((i + 1) % 8 == 0 || i == chunk->count - 1)
         {
-            printf("\t(line %d)\n", chunk->lines[i]);
+            printf("\t(line %d)\n", getLine(chunk, i));
         }
     }
     printf("\n");
 }
+
+
+// Adds every pair of adjacent opcodes in a function, and in all functions nested inside it, to pairs[first][second].
+// Superinstructions are counted as the sequence they replaced, so the numbers don't depend on the fused set.
+void countOpcodePairs(ObjFunction *function, unsigned long pairs[UINT8_COUNT][UINT8_COUNT])
+{
+    Chunk *chunk = &function->chunk;
+    int previous = -1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        int length = 1;
+        const uint8_t *sequence = fusedSequence(chunk->code[offset], &length);
+        if (sequence == NULL)
+            sequence = &chunk->code[offset];
+
+        for (int i = 0; i < length; i++)
+        {
+            if (previous != -1)
+                pairs[previous][sequence[i]]++;
+            previous = sequence[i];
+        }
+    }
+
+    // Nested functions are stored as constants of the function that declares them.
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        if (IS_FUNCTION(chunk->constants.values[i]))
+            countOpcodePairs(AS_FUNCTION(chunk->constants.values[i]), pairs);
+    }
+}
+
+// Prints the counted opcode pairs, most frequent first, with each pair's share of the total.
+void printOpcodePairs(unsigned long pairs[UINT8_COUNT][UINT8_COUNT])
+{
+    unsigned long total = 0;
+    for (int a = 0; a < UINT8_COUNT; a++)
+        for (int b = 0; b < UINT8_COUNT; b++)
+            total += pairs[a][b];
+
+    // Repeatedly picks the largest remaining count. The table is small, so there is no need to sort.
+    unsigned long printed = 0;
+    while (printed < total)
+    {
+        int bestA = 0, bestB = 0;
+        for (int a = 0; a < UINT8_COUNT; a++)
+            for (int b = 0; b < UINT8_COUNT; b++)
+                if (pairs[a][b] > pairs[bestA][bestB])
+                {
+                    bestA = a;
+                    bestB = b;
+                }
+
+        unsigned long count = pairs[bestA][bestB];
+        printf("%8lu %5.1f%%  %s %s\n", count, 100.0 * count / total, opcodeName(bestA), opcodeName(bestB));
+        printed += count;
+        pairs[bestA][bestB] = 0;
+    }
+}
+
+#ifdef DEBUG_COUNT_OPCODES
+OpcodeCounters opcodeCounters;
+
+// Saves a function's instruction count before it is freed. Runs during a collection, so the list is grown
+// with plain realloc rather than reallocate(), which could start another one.
+void recordFunctionCount(ObjFunction *function)
+{
+    if (function->instructionCount == 0)
+        return;
+
+    const char *name = function->name != NULL ? function->name->chars : "script";
+    int line = getLine(&function->chunk, 0);
+
+    // The same source compiled twice (in the REPL, say) adds up under one entry.
+    for (int i = 0; i < opcodeCounters.functionCount; i++)
+    {
+        FunctionCount *count = &opcodeCounters.functions[i];
+        if (count->line == line && strcmp(count->name, name) == 0)
+        {
+            count->instructions += function->instructionCount;
+            return;
+        }
+    }
+
+    if (opcodeCounters.functionCapacity < opcodeCounters.functionCount + 1)
+    {
+        opcodeCounters.functionCapacity = opcodeCounters.functionCapacity < 8 ? 8 : opcodeCounters.functionCapacity * 2;
+        opcodeCounters.functions = realloc(opcodeCounters.functions, sizeof(FunctionCount) * opcodeCounters.functionCapacity);
+        if (opcodeCounters.functions == NULL)
+            exit(1);
+    }
+
+    FunctionCount *count = &opcodeCounters.functions[opcodeCounters.functionCount++];
+    count->name = malloc(strlen(name) + 1);
+    if (count->name == NULL)
+        exit(1);
+    strcpy(count->name, name);
+    count->line = line;
+    count->instructions = function->instructionCount;
+}
+
+// Writes the counters as JSON to the file named by $NPA_COUNTS, or npa-counts.json. Pairs and functions are
+// listed most frequent first. Called by freeVM() once every function has been freed and recorded.
+void writeOpcodeCounts()
+{
+    const char *path = getenv("NPA_COUNTS");
+    if (path == NULL)
+        path = "npa-counts.json";
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not write opcode counts to \"%s\".\n", path);
+        return;
+    }
+
+    uint64_t total = 0;
+    fprintf(file, "{\n  \"opcodes\": {");
+    const char *separator = "";
+    for (int i = 0; i < UINT8_COUNT; i++)
+    {
+        if (opcodeCounters.opcodes[i] == 0)
+            continue;
+        fprintf(file, "%s\n    \"%s\": %llu", separator, opcodeName(i), (unsigned long long)opcodeCounters.opcodes[i]);
+        total += opcodeCounters.opcodes[i];
+        separator = ",";
+    }
+    fprintf(file, "\n  },\n  \"total\": %llu,\n", (unsigned long long)total);
+
+    // Repeatedly picks the largest remaining pair, like printOpcodePairs(). Only opcodes that ran can pair up.
+    fprintf(file, "  \"pairs\": [");
+    separator = "";
+    for (;;)
+    {
+        int bestA = 0, bestB = 0;
+        for (int a = 0; a < UINT8_COUNT; a++)
+        {
+            if (opcodeCounters.opcodes[a] == 0)
+                continue;
+            for (int b = 0; b < UINT8_COUNT; b++)
+                if (opcodeCounters.pairs[a][b] > opcodeCounters.pairs[bestA][bestB])
+                {
+                    bestA = a;
+                    bestB = b;
+                }
+        }
+        if (opcodeCounters.pairs[bestA][bestB] == 0)
+            break;
+
+        fprintf(file, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}", separator,
+                opcodeName(bestA), opcodeName(bestB), (unsigned long long)opcodeCounters.pairs[bestA][bestB]);
+        opcodeCounters.pairs[bestA][bestB] = 0;
+        separator = ",";
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"functions\": [");
+    separator = "";
+    for (;;)
+    {
+        FunctionCount *best = NULL;
+        for (int i = 0; i < opcodeCounters.functionCount; i++)
+        {
+            FunctionCount *count = &opcodeCounters.functions[i];
+            if (count->name != NULL && (best == NULL || count->instructions > best->instructions))
+                best = count;
+        }
+        if (best == NULL)
+            break;
+
+        fprintf(file, "%s\n    {\"name\": \"%s\", \"line\": %d, \"instructions\": %llu}", separator, best->name,
+                best->line, (unsigned long long)best->instructions);
+        free(best->name);
+        best->name = NULL;
+        separator = ",";
+    }
+    fprintf(file, "\n  ],\n");
+
+    fprintf(file, "  \"tables\": {\"lookups\": %llu, \"probes\": %llu}\n}\n",
+            (unsigned long long)opcodeCounters.tableLookups, (unsigned long long)opcodeCounters.tableProbes);
+    fclose(file);
+
+    free(opcodeCounters.functions);
+    opcodeCounters.functions = NULL;
+    opcodeCounters.functionCount = 0;
+    opcodeCounters.functionCapacity = 0;
+}
+#endif
@@ -2,8 +2,51 @@
 #define npa_debug_h
 
 #include "chunk.h"
+#include "object.h"
 
 void disassembleChunk(Chunk *chunk, const char *name);
 int disassembleInstruction(Chunk *chunk, int offset);
+void printBytecode(Chunk *chunk);
+const char *opcodeName(uint8_t instruction);
+void countOpcodePairs(ObjFunction *function, unsigned long pairs[UINT8_COUNT][UINT8_COUNT]);
+void printOpcodePairs(unsigned long pairs[UINT8_COUNT][UINT8_COUNT]);
+
+#ifdef DEBUG_COUNT_OPCODES
+// Instructions run by one function, kept after the function itself is freed.
+typedef struct
+{
+    char *name; // Function name, "script" for top-level code.
+    int line;   // Line the function starts on, to tell same-named functions apart.
+    uint64_t instructions;
+} FunctionCount;
+
+// Execution counters for the instrumented build. Only run() counts; code running natively under --jit doesn't.
+typedef struct
+{
+    uint64_t opcodes[UINT8_COUNT];
+    uint64_t pairs[UINT8_COUNT][UINT8_COUNT]; // [previous][current]
+    uint8_t previous;                         // Last opcode dispatched.
+    uint64_t tableLookups;                    // Hash table searches.
+    uint64_t tableProbes;                     // Groups of slots looked at by those searches.
+
+    FunctionCount *functions;
+    int functionCount;
+    int functionCapacity;
+} OpcodeCounters;
+
+extern OpcodeCounters opcodeCounters;
+
+// Counts one dispatch of the instruction, run on behalf of the function.
+static inline void countInstruction(ObjFunction *function, uint8_t instruction)
+{
+    opcodeCounters.opcodes[instruction]++;
+    opcodeCounters.pairs[opcodeCounters.previous][instruction]++;
+    opcodeCounters.previous = instruction;
+    function->instructionCount++;
+}
+
+void recordFunctionCount(ObjFunction *function);
+void writeOpcodeCounts();
+#endif
 
 #endif
\ No newline at end of file
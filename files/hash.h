@@ -0,0 +1,105 @@
+#ifndef npa_hash_h
+#define npa_hash_h
+
+#include <string.h>
+
+#include "common.h"
+
+// String hashing for the intern table. It follows the design of wyhash: the input is read 8 or 16 bytes at a
+// time and each block is folded in with one 64x64->128-bit multiply, so long strings cost a fraction of a
+// byte-at-a-time hash, while strings of up to 16 bytes (most identifiers) take two overlapping reads and no
+// loop at all. Hashes never leave the process, so reading in native byte order is fine.
+// bench/hash.c compares it with the FNV-1a it replaced.
+
+#define HASH_SECRET0 0xa0761d6478bd642full
+#define HASH_SECRET1 0xe7037ed1a0b428dbull
+#define HASH_SECRET2 0x8ebc6af09c88c6e3ull
+
+// Multiplies a by b and folds the 128-bit product down to 64 bits.
+static inline uint64_t hashMix(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t aHigh = a >> 32, aLow = (uint32_t)a, bHigh = b >> 32, bLow = (uint32_t)b;
+    uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow, middle1 = aLow * bHigh, low = aLow * bLow;
+    uint64_t carry = ((low >> 32) + (uint32_t)middle0 + (uint32_t)middle1) >> 32;
+    return (low + (middle0 << 32) + (middle1 << 32)) ^ (high + (middle0 >> 32) + (middle1 >> 32) + carry);
+#endif
+}
+
+static inline uint64_t hashRead64(const uint8_t *bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static inline uint64_t hashRead32(const uint8_t *bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Hashes the length bytes at key.
+static inline uint32_t hashString(const char *key, int length)
+{
+    const uint8_t *bytes = (const uint8_t *)key;
+    size_t remaining = (size_t)length;
+    uint64_t seed = HASH_SECRET0;
+    uint64_t a, b;
+
+    if (remaining <= 16)
+    {
+        if (remaining >= 4)
+        {
+            // Two pairs of 4-byte reads that between them cover every byte.
+            size_t middle = (remaining >> 3) << 2;
+            a = (hashRead32(bytes) << 32) | hashRead32(bytes + middle);
+            b = (hashRead32(bytes + remaining - 4) << 32) | hashRead32(bytes + remaining - 4 - middle);
+        }
+        else if (remaining > 0)
+        {
+            a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[remaining >> 1] << 8) | bytes[remaining - 1];
+            b = 0;
+        }
+        else
+        {
+            a = 0;
+            b = 0;
+        }
+    }
+    else
+    {
+        while (remaining > 16)
+        {
+            seed = hashMix(hashRead64(bytes) ^ HASH_SECRET1, hashRead64(bytes + 8) ^ seed);
+            bytes += 16;
+            remaining -= 16;
+        }
+        // The last 16 bytes of the string, overlapping the final block if it was short.
+        a = hashRead64(bytes + remaining - 16);
+        b = hashRead64(bytes + remaining - 8);
+    }
+
+    uint64_t hash = hashMix(HASH_SECRET2 ^ (uint64_t)length, hashMix(a ^ HASH_SECRET1, b ^ seed));
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// File checksums for the bytecode cache and heap snapshots, where the hash is written out and so has to be the
+// same on every machine: 64-bit FNV-1a, continued from hash over the given bytes. Start from HASH_SEED.
+#define HASH_SEED 14695981039346656037u
+
+static inline uint64_t hashBytes(uint64_t hash, const void *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= ((const uint8_t *)bytes)[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+#endif
@@ -0,0 +1,857 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "common.h"
+#include "jit.h"
+
+#ifdef BASELINE_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "optimizer.h"
+
+// Baseline template JIT for x86-64. Every bytecode instruction is translated on its own into a fixed native
+// sequence; there is no register allocation across instructions and the VM stack stays in memory, so the
+// interpreter can take over at any instruction boundary. Calls, returns, closures, string concatenation and
+// the VM's own runtime errors are left to run(): the native code stores frame->ip and the stack top and returns
+// (a "side exit"), and run() re-enters native code at the next call, return or loop back-edge.
+//
+// Native code never allocates, so the collector only ever sees the VM stack as run() left it. Natives that
+// may allocate are called from run() too. Stores to globals mark the global's card like run() does; storing a
+// young object into an upvalue, or storing into one while an incremental collection is marking, takes the side
+// exit, so run() applies the write barrier.
+
+// x86-64 general purpose registers, numbered as in the instruction encoding.
+typedef enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15
+} Register;
+
+// Registers holding VM state while native code runs. All are callee-saved.
+#define SLOTS RBX          // frame->slots.
+#define STACK_TOP_ADDR R12 // &vm.stackTop.
+#define STACK_TOP R13      // vm.stackTop, written back before helper calls and side exits.
+#define FRAME R14          // The CallFrame being run.
+#define CONSTANTS R15      // The function's constant table.
+
+// Condition codes for Jcc and SETcc.
+typedef enum
+{
+    CC_B = 0x2,
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+    CC_NP = 0xB
+} Condition;
+
+// A rel32 field waiting for its target: a bytecode offset for jumps, the instruction to hand back for side exits.
+typedef struct
+{
+    int at;
+    int offset;
+} Fixup;
+
+typedef struct
+{
+    uint8_t *code;
+    int count;
+    int capacity;
+
+    Fixup *jumps;
+    int jumpCount;
+    int jumpCapacity;
+
+    Fixup *exits;
+    int exitCount;
+    int exitCapacity;
+
+    int exitLabel;  // Shared code that stores the ip and stack top and returns to run().
+    int errorLabel; // Shared code that returns to run() after a runtime error.
+} Assembler;
+
+// Entry stub signature: runs the function from the given native address until the next side exit. Returns
+// false if a native function called from compiled code raised a runtime error.
+typedef bool (*JitEntry)(CallFrame *frame, uint8_t *target);
+
+// What jitCallNative() did.
+typedef enum
+{
+    NATIVE_CALL_ERROR,   // The native reported a runtime error.
+    NATIVE_CALL_DONE,    // The result replaced the arguments.
+    NATIVE_CALL_DEFERRED // Nothing happened; run() has to make the call.
+} NativeCallResult;
+
+static void emit8(Assembler *as, uint8_t byte)
+{
+    if (as->capacity < as->count + 1)
+    {
+        int oldCapacity = as->capacity;
+        as->capacity = GROW_CAPACITY(oldCapacity);
+        as->code = GROW_ARRAY(uint8_t, as->code, oldCapacity, as->capacity);
+    }
+    as->code[as->count++] = byte;
+}
+
+static void emit32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit8(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void emit64(Assembler *as, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+        emit8(as, (uint8_t)(value >> (i * 8)));
+}
+
+static void addFixup(Fixup **fixups, int *count, int *capacity, int at, int offset)
+{
+    if (*capacity < *count + 1)
+    {
+        int oldCapacity = *capacity;
+        *capacity = GROW_CAPACITY(oldCapacity);
+        *fixups = GROW_ARRAY(Fixup, *fixups, oldCapacity, *capacity);
+    }
+    (*fixups)[*count].at = at;
+    (*fixups)[*count].offset = offset;
+    (*count)++;
+}
+
+// Points the rel32 field at `at` to the native offset `target`.
+static void patchRel32(Assembler *as, int at, int target)
+{
+    int32_t rel = target - (at + 4);
+    memcpy(as->code + at, &rel, sizeof(rel));
+}
+
+// REX prefix with W set; reg and base may be any of the sixteen registers.
+static void emitRex(Assembler *as, int reg, int base)
+{
+    emit8(as, 0x48 | ((reg & 8) >> 1) | ((base & 8) >> 3));
+}
+
+// opcode with a [base + disp32] memory operand.
+static void emitMemory(Assembler *as, uint8_t opcode, Register reg, Register base, int32_t disp)
+{
+    emitRex(as, reg, base);
+    emit8(as, opcode);
+    emit8(as, 0x80 | ((reg & 7) << 3) | (base & 7));
+    if ((base & 7) == RSP)
+        emit8(as, 0x24); // rsp and r12 need a SIB byte.
+    emit32(as, (uint32_t)disp);
+}
+
+// mov dst, [base + disp]
+static void emitLoad(Assembler *as, Register dst, Register base, int32_t disp)
+{
+    emitMemory(as, 0x8B, dst, base, disp);
+}
+
+// mov [base + disp], src
+static void emitStore(Assembler *as, Register base, int32_t disp, Register src)
+{
+    emitMemory(as, 0x89, src, base, disp);
+}
+
+// Two register form `op rm, reg`: mov 0x89, add 0x01, or 0x09, and 0x21, sub 0x29, xor 0x31, cmp 0x39.
+static void emitRegisters(Assembler *as, uint8_t opcode, Register rm, Register reg)
+{
+    emitRex(as, reg, rm);
+    emit8(as, opcode);
+    emit8(as, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+// mov reg, imm64
+static void emitMoveImmediate(Assembler *as, Register reg, uint64_t value)
+{
+    emitRex(as, 0, reg);
+    emit8(as, 0xB8 | (reg & 7));
+    emit64(as, value);
+}
+
+// add reg, imm32 (negative to subtract).
+static void emitAddImmediate(Assembler *as, Register reg, int32_t value)
+{
+    emitRex(as, 0, reg);
+    emit8(as, 0x81);
+    emit8(as, 0xC0 | (reg & 7));
+    emit32(as, (uint32_t)value);
+}
+
+static void emitPushRegister(Assembler *as, Register reg)
+{
+    if (reg & 8)
+        emit8(as, 0x41);
+    emit8(as, 0x50 | (reg & 7));
+}
+
+static void emitPopRegister(Assembler *as, Register reg)
+{
+    if (reg & 8)
+        emit8(as, 0x41);
+    emit8(as, 0x58 | (reg & 7));
+}
+
+// movq xmm, reg
+static void emitMoveToXmm(Assembler *as, int xmm, Register reg)
+{
+    emit8(as, 0x66);
+    emitRex(as, xmm, reg);
+    emit8(as, 0x0F);
+    emit8(as, 0x6E);
+    emit8(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// movq reg, xmm
+static void emitMoveFromXmm(Assembler *as, Register reg, int xmm)
+{
+    emit8(as, 0x66);
+    emitRex(as, xmm, reg);
+    emit8(as, 0x0F);
+    emit8(as, 0x7E);
+    emit8(as, 0xC0 | ((xmm & 7) << 3) | (reg & 7));
+}
+
+// Scalar double instruction on xmm registers 0-7: addsd 0x58, mulsd 0x59, subsd 0x5C, divsd 0x5E.
+static void emitSse(Assembler *as, uint8_t prefix, uint8_t opcode, int dst, int src)
+{
+    emit8(as, prefix);
+    emit8(as, 0x0F);
+    emit8(as, opcode);
+    emit8(as, 0xC0 | (dst << 3) | src);
+}
+
+// setcc on one of al, cl, dl, bl.
+static void emitSet(Assembler *as, Condition condition, Register reg)
+{
+    emit8(as, 0x0F);
+    emit8(as, 0x90 | condition);
+    emit8(as, 0xC0 | reg);
+}
+
+// jmp rel32 with the displacement left to patch. Returns the displacement's position.
+static int emitJump(Assembler *as)
+{
+    emit8(as, 0xE9);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// jcc rel32 with the displacement left to patch. Returns the displacement's position.
+static int emitBranch(Assembler *as, Condition condition)
+{
+    emit8(as, 0x0F);
+    emit8(as, 0x80 | condition);
+    emit32(as, 0);
+    return as->count - 4;
+}
+
+// Hands the instruction at offset back to run().
+static void emitExit(Assembler *as, int offset)
+{
+    emit8(as, 0xB8); // mov eax, imm32
+    emit32(as, (uint32_t)offset);
+    patchRel32(as, emitJump(as), as->exitLabel);
+}
+
+// Side exit taken when the flags satisfy the condition. The stub itself goes after the function body.
+static void emitSideExit(Assembler *as, Condition condition, int offset)
+{
+    addFixup(&as->exits, &as->exitCount, &as->exitCapacity, emitBranch(as, condition), offset);
+}
+
+// Branch to the native code of another bytecode instruction, patched once all of them are placed.
+static void emitJumpTo(Assembler *as, int at, int offset)
+{
+    addFixup(&as->jumps, &as->jumpCount, &as->jumpCapacity, at, offset);
+}
+
+// mov reg, imm32 for one of the first eight registers; zero-extends into the full register.
+static void emitMoveImmediate32(Assembler *as, Register reg, uint32_t value)
+{
+    emit8(as, 0xB8 | reg);
+    emit32(as, value);
+}
+
+// Stores the address of the bytecode at offset in frame->ip, for stack traces of errors raised by helpers.
+static void emitStoreIp(Assembler *as, int offset)
+{
+    emitLoad(as, RCX, FRAME, offsetof(CallFrame, closure));
+    emitLoad(as, RCX, RCX, offsetof(ObjClosure, function));
+    emitLoad(as, RCX, RCX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emitAddImmediate(as, RCX, offset);
+    emitStore(as, FRAME, offsetof(CallFrame, ip), RCX);
+}
+
+// cmp reg, imm64. Clobbers rcx.
+static void emitCompareImmediate(Assembler *as, Register reg, uint64_t value)
+{
+    emitMoveImmediate(as, RCX, value);
+    emitRegisters(as, 0x39, reg, RCX);
+}
+
+// Side exit unless reg holds a number. Clobbers rcx and rdi.
+static void emitNumberGuard(Assembler *as, Register reg, int offset)
+{
+    emitMoveImmediate(as, RCX, QNAN);
+    emitRegisters(as, 0x89, RDI, reg);
+    emitRegisters(as, 0x21, RDI, RCX);
+    emitRegisters(as, 0x39, RDI, RCX);
+    emitSideExit(as, CC_E, offset);
+}
+
+// Pushes rax onto the VM stack.
+static void emitPushValue(Assembler *as)
+{
+    emitStore(as, STACK_TOP, 0, RAX);
+    emitAddImmediate(as, STACK_TOP, (int32_t)sizeof(Value));
+}
+
+// Loads the two operands of a binary instruction: a into rax, b into rdx.
+static void emitLoadOperands(Assembler *as)
+{
+    emitLoad(as, RAX, STACK_TOP, -2 * (int32_t)sizeof(Value));
+    emitLoad(as, RDX, STACK_TOP, -(int32_t)sizeof(Value));
+}
+
+// Flips the 0 or 1 in al.
+static void emitFlip(Assembler *as)
+{
+    emit8(as, 0x34); // xor al, 1
+    emit8(as, 0x01);
+}
+
+// Turns the flag in al into a boolean Value in rax.
+static void emitBoolean(Assembler *as)
+{
+    emit8(as, 0x0F); // movzx eax, al
+    emit8(as, 0xB6);
+    emit8(as, 0xC0);
+    emitMoveImmediate(as, RCX, FALSE_VAL);
+    emitRegisters(as, 0x01, RAX, RCX); // TRUE_VAL is FALSE_VAL + 1.
+}
+
+// Replaces the two operands of a binary instruction with rax.
+static void emitBinaryResult(Assembler *as)
+{
+    emitStore(as, STACK_TOP, -2 * (int32_t)sizeof(Value), RAX);
+    emitAddImmediate(as, STACK_TOP, -(int32_t)sizeof(Value));
+}
+
+// Loads the address of the global value array into rdx. It is reloaded on every use because defining new
+// globals (in a later REPL line, say) can move it.
+static void emitGlobalValues(Assembler *as)
+{
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalValues.values);
+    emitLoad(as, RDX, RDX, 0);
+}
+
+// Marks the global's card for the next young collection. Clobbers rdx.
+static void emitGlobalCard(Assembler *as, int slot)
+{
+    emitMoveImmediate(as, RDX, (uint64_t)(uintptr_t)&vm.globalCards);
+    emitLoad(as, RDX, RDX, 0);
+    emitMemory(as, 0xC6, RAX, RDX, slot); // mov byte [rdx + slot], imm8
+    emit8(as, 1);
+}
+
+// Side exit if reg holds a young object. Clobbers rcx and rdi.
+static void emitYoungGuard(Assembler *as, Register reg, int offset)
+{
+    emitMoveImmediate(as, RCX, OBJ_VAL((Obj *)vm.nursery));
+    emitRegisters(as, 0x89, RDI, reg);
+    emitRegisters(as, 0x29, RDI, RCX);
+    emitMoveImmediate(as, RCX, NURSERY_SIZE);
+    emitRegisters(as, 0x39, RDI, RCX);
+    emitSideExit(as, CC_B, offset);
+}
+
+// Side exit while an incremental collection is marking. Clobbers rcx.
+static void emitMarkingGuard(Assembler *as, int offset)
+{
+    emitMoveImmediate(as, RCX, (uint64_t)(uintptr_t)&vm.gcPhase);
+    emitMemory(as, 0x80, RDI, RCX, 0); // cmp byte [rcx], imm8 (rdi encodes /7)
+    emit8(as, GC_MARK);
+    emitSideExit(as, CC_E, offset);
+}
+
+// Loads the upvalue's location pointer into rax. The upvalue pointers are stored inside the closure.
+static void emitUpvalueLocation(Assembler *as, int slot)
+{
+    emitLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+    emitLoad(as, RAX, RAX, offsetof(ObjClosure, upvalues) + slot * (int32_t)sizeof(ObjUpvalue *));
+    emitLoad(as, RAX, RAX, offsetof(ObjUpvalue, location));
+}
+
+static void emitArithmetic(Assembler *as, uint8_t opcode, int offset)
+{
+    emitLoadOperands(as);
+    emitNumberGuard(as, RAX, offset);
+    emitNumberGuard(as, RDX, offset);
+    emitMoveToXmm(as, 0, RAX);
+    emitMoveToXmm(as, 1, RDX);
+    emitSse(as, 0xF2, opcode, 0, 1);
+    emitMoveFromXmm(as, RAX, 0);
+    emitBinaryResult(as);
+}
+
+// a > b sets "above" for ucomisd a, b; a < b is b > a. Both are false for NaN.
+// OP_GREATER/OP_LESS, or with negate set OP_LESS_EQUAL/OP_GREATER_EQUAL, which are the same compare with the
+// answer flipped (so NaN still gives what the OP_NOT pair did).
+static void emitComparison(Assembler *as, bool less, bool negate, int offset)
+{
+    emitLoadOperands(as);
+    emitNumberGuard(as, RAX, offset);
+    emitNumberGuard(as, RDX, offset);
+    emitMoveToXmm(as, 0, RAX);
+    emitMoveToXmm(as, 1, RDX);
+    if (less)
+        emitSse(as, 0x66, 0x2E, 1, 0);
+    else
+        emitSse(as, 0x66, 0x2E, 0, 1);
+    emitSet(as, CC_A, RAX);
+    if (negate)
+        emitFlip(as);
+    emitBoolean(as);
+    emitBinaryResult(as);
+}
+
+// Whether either operand of an equality test is a rope, which only run() can flatten.
+static bool jitHasRope(Value a, Value b)
+{
+    return IS_ROPE(a) || IS_ROPE(b);
+}
+
+// valuesEqual(): two numbers compare as doubles, anything else compares bit for bit. Values with different
+// bits can still be equal if one is a rope; jitHasRope() checks for that and those tests take the side exit.
+// OP_NOT_EQUAL negates the result.
+static void emitEqual(Assembler *as, bool negate, int offset)
+{
+    emitLoadOperands(as);
+    emitMoveImmediate(as, RCX, QNAN);
+    emitRegisters(as, 0x89, RDI, RAX);
+    emitRegisters(as, 0x21, RDI, RCX);
+    emitRegisters(as, 0x39, RDI, RCX);
+    int aNotNumber = emitBranch(as, CC_E);
+    emitRegisters(as, 0x89, RDI, RDX);
+    emitRegisters(as, 0x21, RDI, RCX);
+    emitRegisters(as, 0x39, RDI, RCX);
+    int bNotNumber = emitBranch(as, CC_E);
+
+    emitMoveToXmm(as, 0, RAX);
+    emitMoveToXmm(as, 1, RDX);
+    emitSse(as, 0x66, 0x2E, 0, 1);
+    emitSet(as, CC_E, RAX);
+    emitSet(as, CC_NP, RDX); // Unordered (NaN) also sets ZF.
+    emit8(as, 0x20);         // and al, dl
+    emit8(as, 0xD0);
+    int done = emitJump(as);
+
+    patchRel32(as, aNotNumber, as->count);
+    patchRel32(as, bNotNumber, as->count);
+    emitRegisters(as, 0x89, RDI, RAX);
+    emitRegisters(as, 0x89, RSI, RDX);
+    emitRegisters(as, 0x39, RDI, RSI);
+    int same = emitBranch(as, CC_E);
+    emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)jitHasRope);
+    emit8(as, 0xFF); // call rax
+    emit8(as, 0xD0);
+    emit8(as, 0x84); // test al, al
+    emit8(as, 0xC0);
+    emitSideExit(as, CC_NE, offset);
+    int different = emitJump(as); // al is 0.
+    patchRel32(as, same, as->count);
+    emitMoveImmediate32(as, RAX, 1);
+
+    patchRel32(as, done, as->count);
+    patchRel32(as, different, as->count);
+    if (negate)
+        emitFlip(as);
+    emitBoolean(as);
+    emitBinaryResult(as);
+}
+
+// Called from native code with vm.stackTop up to date.
+static void jitPrint()
+{
+    printValue(pop());
+}
+
+// OP_CALL_NATIVE from native code. Natives that may allocate are deferred to run() so collections only happen
+// there, and so is a global that no longer holds a native.
+static NativeCallResult jitCallNative(int slot, int argCount)
+{
+    Value callee = vm.globalValues.values[slot];
+    if (!IS_NATIVE(callee) || (AS_NATIVE(callee)->flags & NATIVE_ALLOCATES))
+        return NATIVE_CALL_DEFERRED;
+    return callNative(AS_NATIVE(callee), argCount) ? NATIVE_CALL_DONE : NATIVE_CALL_ERROR;
+}
+
+static void emitInstruction(Assembler *as, Chunk *chunk, int offset, uint8_t instruction)
+{
+    uint8_t *operands = chunk->code + offset + 1;
+    int32_t top = -(int32_t)sizeof(Value);
+
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+        emitLoad(as, RAX, CONSTANTS, operands[0] * (int32_t)sizeof(Value));
+        emitPushValue(as);
+        break;
+    case OP_NIL:
+        emitMoveImmediate(as, RAX, NIL_VAL);
+        emitPushValue(as);
+        break;
+    case OP_TRUE:
+        emitMoveImmediate(as, RAX, TRUE_VAL);
+        emitPushValue(as);
+        break;
+    case OP_FALSE:
+        emitMoveImmediate(as, RAX, FALSE_VAL);
+        emitPushValue(as);
+        break;
+    case OP_POP:
+        emitAddImmediate(as, STACK_TOP, top);
+        break;
+    case OP_GET_LOCAL:
+        emitLoad(as, RAX, SLOTS, operands[0] * (int32_t)sizeof(Value));
+        emitPushValue(as);
+        break;
+    case OP_SET_LOCAL:
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitStore(as, SLOTS, operands[0] * (int32_t)sizeof(Value), RAX);
+        break;
+    case OP_GET_GLOBAL:
+    {
+        int slot = (operands[0] << 8) | operands[1];
+        emitGlobalValues(as);
+        emitLoad(as, RAX, RDX, slot * (int32_t)sizeof(Value));
+        emitCompareImmediate(as, RAX, UNDEFINED_VAL);
+        emitSideExit(as, CC_E, offset); // run() reports the undefined variable.
+        emitPushValue(as);
+        break;
+    }
+    case OP_DEFINE_GLOBAL:
+    {
+        int slot = (operands[0] << 8) | operands[1];
+        emitGlobalValues(as);
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitStore(as, RDX, slot * (int32_t)sizeof(Value), RAX);
+        emitGlobalCard(as, slot);
+        emitAddImmediate(as, STACK_TOP, top);
+        break;
+    }
+    case OP_SET_GLOBAL:
+    {
+        int slot = (operands[0] << 8) | operands[1];
+        emitGlobalValues(as);
+        emitLoad(as, RAX, RDX, slot * (int32_t)sizeof(Value));
+        emitCompareImmediate(as, RAX, UNDEFINED_VAL);
+        emitSideExit(as, CC_E, offset);
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitStore(as, RDX, slot * (int32_t)sizeof(Value), RAX);
+        emitGlobalCard(as, slot);
+        break;
+    }
+    case OP_GET_UPVALUE:
+        emitUpvalueLocation(as, operands[0]);
+        emitLoad(as, RAX, RAX, 0);
+        emitPushValue(as);
+        break;
+    case OP_SET_UPVALUE:
+        emitUpvalueLocation(as, operands[0]);
+        emitLoad(as, RDX, STACK_TOP, top);
+        emitYoungGuard(as, RDX, offset);
+        emitMarkingGuard(as, offset);
+        emitStore(as, RAX, 0, RDX);
+        break;
+    case OP_GET_CALLER_LOCAL:
+        emitLoad(as, RAX, FRAME, (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+        emitLoad(as, RAX, RAX, operands[0] * (int32_t)sizeof(Value));
+        emitPushValue(as);
+        break;
+    case OP_SET_CALLER_LOCAL:
+        emitLoad(as, RAX, FRAME, (int32_t)offsetof(CallFrame, slots) - (int32_t)sizeof(CallFrame));
+        emitLoad(as, RDX, STACK_TOP, top);
+        emitStore(as, RAX, operands[0] * (int32_t)sizeof(Value), RDX);
+        break;
+    case OP_EQUAL:
+    case OP_EQUAL_NUM:
+        emitEqual(as, false, offset);
+        break;
+    case OP_NOT_EQUAL:
+        emitEqual(as, true, offset);
+        break;
+    case OP_GREATER:
+        emitComparison(as, false, false, offset);
+        break;
+    case OP_LESS:
+        emitComparison(as, true, false, offset);
+        break;
+    case OP_GREATER_EQUAL:
+        emitComparison(as, true, true, offset);
+        break;
+    case OP_LESS_EQUAL:
+        emitComparison(as, false, true, offset);
+        break;
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        emitArithmetic(as, 0x58, offset); // Strings take the side exit.
+        break;
+    case OP_SUBTRACT:
+        emitArithmetic(as, 0x5C, offset);
+        break;
+    case OP_MULTIPLY:
+        emitArithmetic(as, 0x59, offset);
+        break;
+    case OP_DIVIDE:
+        emitArithmetic(as, 0x5E, offset);
+        break;
+    case OP_NOT:
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitCompareImmediate(as, RAX, NIL_VAL);
+        emitSet(as, CC_E, RDX);
+        emitCompareImmediate(as, RAX, FALSE_VAL);
+        emitSet(as, CC_E, RAX);
+        emit8(as, 0x08); // or al, dl
+        emit8(as, 0xD0);
+        emitBoolean(as);
+        emitStore(as, STACK_TOP, top, RAX);
+        break;
+    case OP_NEGATE:
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitNumberGuard(as, RAX, offset);
+        emitMoveImmediate(as, RCX, SIGN_BIT);
+        emitRegisters(as, 0x31, RAX, RCX);
+        emitStore(as, STACK_TOP, top, RAX);
+        break;
+    case OP_PRINT:
+        emitStore(as, STACK_TOP_ADDR, 0, STACK_TOP);
+        emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)jitPrint);
+        emit8(as, 0xFF); // call rax
+        emit8(as, 0xD0);
+        emitLoad(as, STACK_TOP, STACK_TOP_ADDR, 0);
+        break;
+    case OP_JUMP:
+        emitJumpTo(as, emitJump(as), offset + 3 + ((operands[0] << 8) | operands[1]));
+        break;
+    case OP_JUMP_IF_FALSE:
+    {
+        int target = offset + 3 + ((operands[0] << 8) | operands[1]);
+        emitLoad(as, RAX, STACK_TOP, top);
+        emitCompareImmediate(as, RAX, NIL_VAL);
+        emitJumpTo(as, emitBranch(as, CC_E), target);
+        emitCompareImmediate(as, RAX, FALSE_VAL);
+        emitJumpTo(as, emitBranch(as, CC_E), target);
+        break;
+    }
+    case OP_LOOP:
+        emitJumpTo(as, emitJump(as), offset + 3 - ((operands[0] << 8) | operands[1]));
+        break;
+    case OP_CALL_NATIVE:
+        emitStoreIp(as, offset + 4);
+        emitStore(as, STACK_TOP_ADDR, 0, STACK_TOP);
+        emitMoveImmediate32(as, RDI, (operands[0] << 8) | operands[1]);
+        emitMoveImmediate32(as, RSI, operands[2]);
+        emitMoveImmediate(as, RAX, (uint64_t)(uintptr_t)jitCallNative);
+        emit8(as, 0xFF); // call rax
+        emit8(as, 0xD0);
+        emitLoad(as, STACK_TOP, STACK_TOP_ADDR, 0);
+        emit8(as, 0x3D); // cmp eax, imm32
+        emit32(as, NATIVE_CALL_DEFERRED);
+        emitSideExit(as, CC_E, offset);
+        emit8(as, 0x3D);
+        emit32(as, NATIVE_CALL_ERROR);
+        patchRel32(as, emitBranch(as, CC_E), as->errorLabel);
+        break;
+    default:
+        // OP_CALL, OP_TAIL_CALL, OP_CLOSURE, OP_CLOSE_UPVALUE, OP_RETURN and anything newer run in run().
+        emitExit(as, offset);
+        break;
+    }
+}
+
+// Saves the callee-saved registers, loads the VM state and jumps to the native address in rsi.
+static void emitEntry(Assembler *as)
+{
+    emitPushRegister(as, RBX);
+    emitPushRegister(as, RBP);
+    emitPushRegister(as, R12);
+    emitPushRegister(as, R13);
+    emitPushRegister(as, R14);
+    emitPushRegister(as, R15);
+    emitAddImmediate(as, RSP, -8); // Keeps helper calls 16-byte aligned.
+
+    emitRegisters(as, 0x89, FRAME, RDI);
+    emitLoad(as, SLOTS, FRAME, offsetof(CallFrame, slots));
+    emitMoveImmediate(as, STACK_TOP_ADDR, (uint64_t)(uintptr_t)&vm.stackTop);
+    emitLoad(as, STACK_TOP, STACK_TOP_ADDR, 0);
+    emitLoad(as, RAX, FRAME, offsetof(CallFrame, closure));
+    emitLoad(as, RAX, RAX, offsetof(ObjClosure, function));
+    emitLoad(as, CONSTANTS, RAX, offsetof(ObjFunction, chunk) + offsetof(Chunk, constants) + offsetof(ValueArray, values));
+
+    emit8(as, 0xFF); // jmp rsi
+    emit8(as, 0xE6);
+}
+
+// Restores the callee-saved registers and returns eax to jitResume().
+static void emitReturnToRun(Assembler *as)
+{
+    emitAddImmediate(as, RSP, 8);
+    emitPopRegister(as, R15);
+    emitPopRegister(as, R14);
+    emitPopRegister(as, R13);
+    emitPopRegister(as, R12);
+    emitPopRegister(as, RBP);
+    emitPopRegister(as, RBX);
+    emit8(as, 0xC3); // ret
+}
+
+// Shared side exit. eax holds the bytecode offset to resume at.
+static void emitExitSequence(Assembler *as)
+{
+    emitLoad(as, RCX, FRAME, offsetof(CallFrame, closure));
+    emitLoad(as, RCX, RCX, offsetof(ObjClosure, function));
+    emitLoad(as, RCX, RCX, offsetof(ObjFunction, chunk) + offsetof(Chunk, code));
+    emitRegisters(as, 0x01, RCX, RAX);
+    emitStore(as, FRAME, offsetof(CallFrame, ip), RCX);
+    emitStore(as, STACK_TOP_ADDR, 0, STACK_TOP);
+    emitMoveImmediate32(as, RAX, true);
+    emitReturnToRun(as);
+}
+
+// Shared exit after a runtime error. The error has already been reported and the VM stack reset.
+static void emitErrorSequence(Assembler *as)
+{
+    emitMoveImmediate32(as, RAX, false);
+    emitReturnToRun(as);
+}
+
+static void freeAssembler(Assembler *as)
+{
+    FREE_ARRAY(uint8_t, as->code, as->capacity);
+    FREE_ARRAY(Fixup, as->jumps, as->jumpCapacity);
+    FREE_ARRAY(Fixup, as->exits, as->exitCapacity);
+}
+
+// Compiles the function to native code. Returns false if no executable memory could be mapped.
+bool jitCompile(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    Assembler as = {0};
+
+    emitEntry(&as);
+    as.exitLabel = as.count;
+    emitExitSequence(&as);
+    as.errorLabel = as.count;
+    emitErrorSequence(&as);
+
+    int32_t *entries = ALLOCATE(int32_t, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        entries[i] = -1;
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        entries[offset] = as.count;
+
+        int length;
+        const uint8_t *sequence = fusedSequence(chunk->code[offset], &length);
+        if (sequence == NULL)
+        {
+            emitInstruction(&as, chunk, offset, chunk->code[offset]);
+            continue;
+        }
+
+        // The original instructions are still in place behind a superinstruction's opcode; compile them one
+        // by one so each keeps its own offset to side exit to.
+        int component = offset;
+        for (int i = 0; i < length; i++)
+        {
+            emitInstruction(&as, chunk, component, sequence[i]);
+            component += opcodeLength(chunk, sequence[i], component);
+        }
+    }
+
+    for (int i = 0; i < as.jumpCount; i++)
+    {
+        int target = as.jumps[i].offset;
+        if (entries[target] >= 0)
+            patchRel32(&as, as.jumps[i].at, entries[target]);
+        else
+            addFixup(&as.exits, &as.exitCount, &as.exitCapacity, as.jumps[i].at, target);
+    }
+
+    // Side-exit stubs live after the body so the fast paths fall straight through.
+    for (int i = 0; i < as.exitCount; i++)
+    {
+        patchRel32(&as, as.exits[i].at, as.count);
+        emitExit(&as, as.exits[i].offset);
+    }
+
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)as.count + pageSize - 1) / pageSize * pageSize;
+    uint8_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+    {
+        FREE_ARRAY(int32_t, entries, chunk->count);
+        freeAssembler(&as);
+        return false;
+    }
+    memcpy(code, as.code, as.count);
+    mprotect(code, size, PROT_READ | PROT_EXEC);
+    freeAssembler(&as);
+
+    JitCode *jit = ALLOCATE(JitCode, 1);
+    jit->code = code;
+    jit->size = size;
+    jit->entries = entries;
+    jit->entryCount = chunk->count;
+    function->jit = jit;
+    return true;
+}
+
+// Runs the frame's function natively from frame->ip up to the next side exit, which leaves frame->ip and
+// vm.stackTop where run() should carry on. Does nothing if frame->ip is not an instruction boundary. Returns
+// false if a runtime error was raised.
+bool jitResume(CallFrame *frame)
+{
+    JitCode *jit = frame->closure->function->jit;
+    int offset = (int)(frame->ip - frame->closure->function->chunk.code);
+    if (jit->entries[offset] < 0)
+        return true;
+
+    JitEntry entry = (JitEntry)(void *)jit->code;
+    return entry(frame, jit->code + jit->entries[offset]);
+}
+
+void freeJitCode(ObjFunction *function)
+{
+    JitCode *jit = function->jit;
+    if (jit == NULL)
+        return;
+
+    munmap(jit->code, jit->size);
+    FREE_ARRAY(int32_t, jit->entries, jit->entryCount);
+    FREE(JitCode, jit);
+    function->jit = NULL;
+}
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef npa_jit_h
+#define npa_jit_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+#ifdef BASELINE_JIT
+
+// Calls plus loop back-edges a function has to run before it gets compiled.
+#define JIT_HOT_THRESHOLD 1000
+
+// Native code for one function, stitched together from a template per bytecode instruction.
+struct JitCode
+{
+    uint8_t *code;    // Executable mapping: entry stub, shared exit, instruction templates, side-exit stubs.
+    size_t size;      // Size of the mapping in bytes.
+    int32_t *entries; // Native offset for each bytecode offset that starts an instruction, -1 elsewhere.
+    int entryCount;   // Number of entries (the chunk's byte count).
+};
+
+bool jitCompile(ObjFunction *function);
+bool jitResume(CallFrame *frame);
+void freeJitCode(ObjFunction *function);
+
+#endif
+
+#endif
@@ -5,8 +5,13 @@
 
 // Project-specific headers for common definitions, chunk data structures, debugging, and the virtual machine.
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
+#include "memory.h"
+#include "profiler.h"
+#include "snapshot.h"
 #include "vm.h"
 
 // REPL (Read-Eval-Print Loop) function for interactive execution.
@@ -69,38 +74,172 @@ static char *readFile(const char *path)
     return buffer; // Returns the file contents as a string.
 }
 
+// Returns the path of a script's bytecode cache: the script's path with a 'c' appended.
+static char *cachePath(const char *path)
+{
+    size_t length = strlen(path);
+    char *cache = (char *)malloc(length + 2);
+    memcpy(cache, path, length);
+    cache[length] = 'c';
+    cache[length + 1] = '\0';
+    return cache;
+}
+
 // Function to run a script from a file.
 static void runFile(const char *path)
 {
-    char *source = readFile(path);              // Reads the file contents.
-    InterpretResult result = interpret(source); // Interprets the script.
-    free(source);                               // Frees the memory allocated for the script.
-
-    // Exits with specific error codes based on the result of interpretation.
+    char *source = readFile(path); // Reads the file contents.
+
+    // Runs the cached bytecode when it was compiled from this exact source; otherwise compiles as usual.
+    char *cache = cachePath(path);
+    ObjFunction *function = loadBytecodeCache(source, cache);
+    free(cache);
+    InterpretResult result = function != NULL ? interpretFunction(function) : interpret(source);
+    free(source); // Frees the memory allocated for the script.
+
+    // Exits with specific error codes based on the result of interpretation. The VM is freed first so its
+    // shutdown output (the DEBUG_COUNT_OPCODES report) isn't lost.
+    if (result != INTERPRET_OK)
+        freeVM();
     if (result == INTERPRET_COMPILE_ERROR)
         exit(65);
     if (result == INTERPRET_RUNTIME_ERROR)
         exit(70);
 }
 
+// Compiles a script and writes its bytecode cache without running it.
+static void compileFile(const char *path)
+{
+    char *source = readFile(path);
+    ObjFunction *function = compile(source);
+    if (function == NULL)
+    {
+        freeVM();
+        exit(65);
+    }
+
+    push(OBJ_VAL(function)); // Keeps the function alive while the cache is written.
+    char *cache = cachePath(path);
+    if (!writeBytecodeCache(function, source, cache))
+    {
+        fprintf(stderr, "Could not write \"%s\".\n", cache);
+        exit(74);
+    }
+    pop();
+    free(cache);
+    free(source);
+}
+
+// Compiles each script without running it and prints how often each pair of adjacent opcodes occurs.
+// This is the data the superinstruction set in optimizer.c is picked from.
+static void mineOpcodePairs(int count, const char *paths[])
+{
+    static unsigned long pairs[UINT8_COUNT][UINT8_COUNT];
+    for (int i = 0; i < count; i++)
+    {
+        char *source = readFile(paths[i]);
+        ObjFunction *function = compile(source);
+        free(source);
+
+        if (function == NULL)
+            exit(65);
+        countOpcodePairs(function, pairs);
+    }
+
+    printOpcodePairs(pairs);
+}
+
 // Main function: Entry point of the program.
 int main(int argc, const char *argv[])
 {
     initVM(); // Initializes the virtual machine.
 
+    // Options come before the script path.
+    int arg = 1;
+    for (; arg < argc; arg++)
+    {
+        if (strcmp(argv[arg], "--jit") == 0)
+        {
+#ifdef BASELINE_JIT
+            vm.jitEnabled = true; // Compiles hot functions to native code.
+#else
+            fprintf(stderr, "npa: --jit is not supported on this platform, running interpreted.\n");
+#endif
+        }
+        else if (strcmp(argv[arg], "--profile") == 0 || strncmp(argv[arg], "--profile=", 10) == 0)
+        {
+            // Samples the call stack and writes collapsed stacks for flame graph tools when the VM is freed.
+            const char *path = argv[arg][9] == '=' ? argv[arg] + 10 : "npa.folded";
+#ifdef SAMPLING_PROFILER
+            if (!startProfiler(path))
+                fprintf(stderr, "npa: could not start the profiler.\n");
+#else
+            (void)path;
+            fprintf(stderr, "npa: --profile is not supported on this platform.\n");
+#endif
+        }
+        else if (strncmp(argv[arg], "--gc-pause=", 11) == 0)
+        {
+            // Collects the old generation in slices of about this many microseconds instead of all at once.
+            vm.gcPauseBudget = (uint32_t)strtoul(argv[arg] + 11, NULL, 10);
+        }
+        else if (strcmp(argv[arg], "--gc-concurrent") == 0)
+        {
+#ifdef CONCURRENT_GC
+            vm.gcConcurrent = true; // Marks the old generation on a background thread.
+#else
+            fprintf(stderr, "npa: --gc-concurrent is not supported on this platform, collecting on one thread.\n");
+#endif
+        }
+        else if (strcmp(argv[arg], "--gc-stats") == 0)
+        {
+            startGcStats(); // Prints collector pause times when the VM is freed.
+        }
+        else if (strncmp(argv[arg], "--snapshot=", 11) == 0)
+        {
+            // Restores the globals a prelude left behind instead of running the prelude again.
+            if (!loadSnapshot(argv[arg] + 11))
+            {
+                fprintf(stderr, "Could not restore snapshot \"%s\".\n", argv[arg] + 11);
+                exit(74);
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
     // Determines the mode of operation based on command-line arguments.
-    if (argc == 1)
+    if (argc == arg)
     {
         repl(); // Starts the REPL for interactive execution.
     }
-    else if (argc == 2)
+    else if (argc == arg + 1 && strncmp(argv[arg], "--", 2) != 0)
+    {
+        runFile(argv[arg]); // Executes a script file.
+    }
+    else if (argc == arg + 3 && strcmp(argv[arg], "--make-snapshot") == 0)
+    {
+        runFile(argv[arg + 2]); // Runs the prelude, then saves the heap it leaves behind.
+        if (!writeSnapshot(argv[arg + 1]))
+        {
+            fprintf(stderr, "Could not write snapshot \"%s\".\n", argv[arg + 1]);
+            exit(74);
+        }
+    }
+    else if (argc == arg + 2 && strcmp(argv[arg], "--compile-only") == 0)
+    {
+        compileFile(argv[arg + 1]); // Writes the script's bytecode cache.
+    }
+    else if (argc > arg + 1 && strcmp(argv[arg], "--op-pairs") == 0)
     {
-        runFile(argv[1]); // Executes a script file.
+        mineOpcodePairs(argc - arg - 1, argv + arg + 1); // Prints opcode pair statistics for the given scripts.
     }
     else
     {
-        fprintf(stderr, "Usage: npa [path]\n"); // Error message for incorrect usage.
-        exit(64);                               // Exits with a usage error code.
+        fprintf(stderr, "Usage: npa [--jit] [--profile[=file]] [--gc-pause=us] [--gc-concurrent] [--gc-stats] [--snapshot=file] [path]\n       npa --make-snapshot file prelude\n       npa --compile-only path\n       npa --op-pairs path...\n"); // Error message for incorrect usage.
+        exit(64); // Exits with a usage error code.
     }
 
     freeVM(); // Cleans up and frees the virtual machine.
@@ -1,16 +1,123 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "vm.h"
 
-#ifdef DEBUG_LOG_GC
-#include <stdio.h>
+#if defined(DEBUG_LOG_GC) || defined(DEBUG_COUNT_OPCODES)
 #include "debug.h"
 #endif
 
+#ifdef CONCURRENT_GC
+#include <pthread.h>
+#include <signal.h>
+#endif
+
 #define GC_HEAP_GROW_FACTOR 2
 
+// An incremental collection runs a slice each time this many more bytes have been allocated in the old
+// generation. A slice looks at the clock once per GC_CLOCK_STRIDE objects.
+#define GC_SLICE_BYTES (64 * 1024)
+#define GC_CLOCK_STRIDE 64
+
+static void collectIfDue();
+#ifdef DEBUG_STRESS_GC
+static void stressCollector();
+#endif
+
+// Kinds of pause the collector makes.
+typedef enum
+{
+    PAUSE_YOUNG,
+    PAUSE_FULL,  // A whole collection, or the rest of an incremental one.
+    PAUSE_SLICE, // One slice of an incremental collection.
+    PAUSE_KINDS
+} PauseKind;
+
+// Pause times, kept once --gc-stats asks for them and printed when the VM is freed.
+static struct
+{
+    bool enabled;
+    uint64_t *times; // Nanoseconds.
+    int count;
+    int capacity;
+    int kinds[PAUSE_KINDS];
+} pauses;
+
+static uint64_t nanoseconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Records a pause that began at start.
+static void recordPause(uint64_t start, PauseKind kind)
+{
+    if (!pauses.enabled)
+        return;
+
+    if (pauses.capacity < pauses.count + 1)
+    {
+        pauses.capacity = GROW_CAPACITY(pauses.capacity);
+        pauses.times = (uint64_t *)realloc(pauses.times, sizeof(uint64_t) * pauses.capacity);
+        if (pauses.times == NULL)
+            exit(1);
+    }
+    pauses.times[pauses.count++] = nanoseconds() - start;
+    pauses.kinds[kind]++;
+}
+
+void startGcStats()
+{
+    pauses.enabled = true;
+}
+
+static int compareTimes(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// Returns the pth percentile of the sorted pause times, by the nearest-rank method.
+static double percentile(int p)
+{
+    int rank = (pauses.count * p + 99) / 100;
+    return pauses.times[rank > 0 ? rank - 1 : 0] / 1e6;
+}
+
+// Prints the pause times recorded since startGcStats() to stderr.
+void printGcStats()
+{
+    if (!pauses.enabled)
+        return;
+
+    uint64_t total = 0;
+    for (int i = 0; i < pauses.count; i++)
+        total += pauses.times[i];
+    fprintf(stderr, "gc: %d pauses (%d young, %d full, %d incremental slices), %.3f ms in total\n", pauses.count,
+            pauses.kinds[PAUSE_YOUNG], pauses.kinds[PAUSE_FULL], pauses.kinds[PAUSE_SLICE], total / 1e6);
+    if (pauses.count > 0)
+    {
+        qsort(pauses.times, pauses.count, sizeof(uint64_t), compareTimes);
+        fprintf(stderr, "gc pause: p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", percentile(50), percentile(99),
+                percentile(100));
+    }
+
+    free(pauses.times);
+    pauses.times = NULL;
+    pauses.count = pauses.capacity = 0;
+}
+
+// Nursery objects start on 8-byte boundaries, so their sizes are rounded up to that.
+#define NURSERY_ALIGN(size) (((size) + 7) & ~(size_t)7)
+
 // Adjusts the amount of memory allocated and potentially triggers garbage collection.
 void *reallocate(void *pointer, size_t oldSize, size_t newSize)
 {
@@ -18,12 +125,9 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     if (newSize > oldSize)
     {
 #ifdef DEBUG_STRESS_GC
-        collectGarbage(); // Forces garbage collection for stress testing.
+        stressCollector(); // Forces garbage collection for stress testing.
 #endif
-        if (vm.bytesAllocated > vm.nextGC)
-        {
-            collectGarbage(); // Triggers garbage collection when threshold is exceeded.
-        }
+        collectIfDue();
     }
     if (newSize == 0)
     {
@@ -37,10 +141,58 @@ void *reallocate(void *pointer, size_t oldSize, size_t newSize)
     return result;
 }
 
-// Marks an object as 'reachable' to prevent it from being collected.
-void markObject(Obj *object)
+// Bump-allocates an object in the nursery. Returns NULL if it has to go in the old generation instead: outside
+// run(), when it is large, or when the nursery is out of room before a safepoint could empty it.
+Obj *allocateYoung(size_t size)
+{
+    size = NURSERY_ALIGN(size);
+    if (!vm.nurseryOpen || size > LARGE_OBJECT_SIZE || (size_t)(vm.nursery + NURSERY_SIZE - vm.nurseryTop) < size)
+        return NULL;
+
+#ifdef DEBUG_STRESS_GC
+    stressCollector(); // Young allocations skip reallocate(), so they'd otherwise never stress the full collector.
+#endif
+
+    Obj *object = (Obj *)vm.nurseryTop;
+    vm.nurseryTop += size;
+    object->next = NULL;
+    return object;
+}
+
+// Adds an old object to the remembered set.
+void rememberObject(Obj *object)
+{
+    if (vm.rememberedCapacity < vm.rememberedCount + 1)
+    {
+        vm.rememberedCapacity = GROW_CAPACITY(vm.rememberedCapacity);
+        vm.remembered = (Obj **)realloc(vm.remembered, sizeof(Obj *) * vm.rememberedCapacity);
+        if (vm.remembered == NULL)
+            exit(1);
+    }
+    object->isRemembered = true;
+    vm.remembered[vm.rememberedCount++] = object;
+}
+
+// Pushes an object onto a gray stack, growing it if there's no space.
+static void pushGray(GrayStack *gray, Obj *object)
 {
-    if (object == NULL || object->isMarked)
+    if (gray->capacity < gray->count + 1)
+    {
+        gray->capacity = GROW_CAPACITY(gray->capacity);
+        gray->objects = (Obj **)realloc(gray->objects, sizeof(Obj *) * gray->capacity);
+        if (gray->objects == NULL)
+            exit(1); // Exits if memory allocation fails.
+    }
+    gray->objects[gray->count++] = object;
+}
+
+// Marks an object as 'reachable' and pushes it onto the given gray stack. Young objects are never marked: a full
+// collection treats the whole nursery as reachable instead (see markNursery()). The background marker and
+// run() can mark the same object at the same time, so isMarked is accessed atomically; if both see it unmarked,
+// the object is only blackened twice.
+static void markInto(GrayStack *gray, Obj *object)
+{
+    if (object == NULL || isYoung(object) || __atomic_load_n(&object->isMarked, __ATOMIC_RELAXED))
         return; // Avoids marking null or already marked objects.
 
 #ifdef DEBUG_LOG_GC
@@ -49,37 +201,39 @@ void markObject(Obj *object)
     printf("\n");
 #endif
 
-    object->isMarked = true;
+    __atomic_store_n(&object->isMarked, true, __ATOMIC_RELAXED);
+    pushGray(gray, object);
+}
 
-    // Ensure there's space on the gray stack, then push the object onto it.
-    if (vm.grayCapacity < vm.grayCount + 1)
-    {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
-        vm.grayStack = (Obj **)realloc(vm.grayStack, sizeof(Obj *) * vm.grayCapacity);
-        if (vm.grayStack == NULL)
-            exit(1); // Exits if memory allocation fails.
-    }
-    vm.grayStack[vm.grayCount++] = object;
+static void markValueInto(GrayStack *gray, Value value)
+{
+    if (IS_OBJ(value))
+        markInto(gray, AS_OBJ(value));
+}
+
+// Marks an object as 'reachable' to prevent it from being collected.
+void markObject(Obj *object)
+{
+    markInto(&vm.gray, object);
 }
 
 // Marks a value as 'reachable'.
 void markValue(Value value)
 {
-    if (IS_OBJ(value))
-        markObject(AS_OBJ(value));
+    markValueInto(&vm.gray, value);
 }
 
 // Marks all values in a ValueArray as 'reachable'.
-static void markArray(ValueArray *array)
+static void markArray(GrayStack *gray, ValueArray *array)
 {
     for (int i = 0; i < array->count; i++)
     {
-        markValue(array->values[i]);
+        markValueInto(gray, LOAD_REFERENCE(array->values[i]));
     }
 }
 
 // Processes an object and marks its children as 'reachable'.
-static void blackenObject(Obj *object)
+static void blackenObject(GrayStack *gray, Obj *object)
 {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void *)object);
@@ -91,30 +245,61 @@ static void blackenObject(Obj *object)
     case OBJ_CLOSURE:
     {
         ObjClosure *closure = (ObjClosure *)object;
-        markObject((Obj *)closure->function);
+        markInto(gray, (Obj *)LOAD_REFERENCE(closure->function));
 
         for (int i = 0; i < closure->upvalueCount; i++)
         {
-            markObject((Obj *)closure->upvalues[i]);
+            markInto(gray, (Obj *)LOAD_REFERENCE(closure->upvalues[i]));
         }
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
-        markObject((Obj *)function->name);
-        markArray(&function->chunk.constants);
+        markInto(gray, (Obj *)LOAD_REFERENCE(function->name));
+        markArray(gray, &function->chunk.constants);
         break;
     }
     case OBJ_UPVALUE:
-        markValue(((ObjUpvalue *)object)->closed);
+        markValueInto(gray, LOAD_REFERENCE(((ObjUpvalue *)object)->closed));
         break;
     case OBJ_NATIVE:
+        markInto(gray, (Obj *)LOAD_REFERENCE(((ObjNative *)object)->name));
+        break;
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        markInto(gray, LOAD_REFERENCE(rope->left));
+        markInto(gray, LOAD_REFERENCE(rope->right));
+        markInto(gray, (Obj *)LOAD_REFERENCE(rope->flat));
+        break;
+    }
     case OBJ_STRING:
         break;
     }
 }
 
+// Returns the number of bytes an object takes up, header included.
+static size_t objectSize(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+        return sizeof(ObjClosure) + sizeof(ObjUpvalue *) * ((ObjClosure *)object)->upvalueCount;
+    case OBJ_FUNCTION:
+        return sizeof(ObjFunction);
+    case OBJ_NATIVE:
+        return sizeof(ObjNative);
+    case OBJ_ROPE:
+        return sizeof(ObjRope);
+    case OBJ_STRING:
+        return sizeof(ObjString) + ((ObjString *)object)->length + 1;
+    case OBJ_UPVALUE:
+        return sizeof(ObjUpvalue);
+    }
+    return 0;
+}
+
 // Frees an allocated object.
 static void freeObject(Obj *object)
 {
@@ -127,25 +312,29 @@ static void freeObject(Obj *object)
     case OBJ_CLOSURE:
     {
         ObjClosure *closure = (ObjClosure *)object;
-        FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalueCount);
-        FREE(ObjClosure, object);
+        reallocate(object, sizeof(ObjClosure) + sizeof(ObjUpvalue *) * closure->upvalueCount, 0);
         break;
     }
     case OBJ_FUNCTION:
     {
         ObjFunction *function = (ObjFunction *)object;
         freeChunk(&function->chunk);
+#ifdef BASELINE_JIT
+        freeJitCode(function);
+#endif
         FREE(ObjFunction, object);
         break;
     }
     case OBJ_NATIVE:
         FREE(ObjNative, object);
         break;
+    case OBJ_ROPE:
+        FREE(ObjRope, object);
+        break;
     case OBJ_STRING:
     {
         ObjString *string = (ObjString *)object;
-        FREE_ARRAY(char, string->chars, string->length + 1);
-        FREE(ObjString, object);
+        reallocate(object, sizeof(ObjString) + string->length + 1, 0);
         break;
     }
     case OBJ_UPVALUE:
@@ -172,78 +361,531 @@ static void markRoots()
         markObject((Obj *)upvalue);
     }
 
-    markTable(&vm.globals);
+    markTable(&vm.globalSlots);
+    markArray(&vm.gray, &vm.globalValues);
+    markArray(&vm.gray, &vm.globalNames);
     markCompilerRoots();
+#ifdef SAMPLING_PROFILER
+    markProfilerRoots();
+#endif
 }
 // Traces all 'reachable' objects starting from the roots.
 static void traceReferences()
 {
-    while (vm.grayCount > 0)
+    while (vm.gray.count > 0)
     {
-        Obj *object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
+        Obj *object = vm.gray.objects[--vm.gray.count];
+        blackenObject(&vm.gray, object);
     }
 }
 
-// Sweeps (frees) all objects that were not marked as 'reachable'.
-static void sweep()
+#ifdef DEBUG_COUNT_OPCODES
+// Records the instruction counts of the functions about to be freed. This has to happen before any of them is
+// freed, since a function's name can come earlier in the object list than the function itself.
+static void recordUnmarkedFunctions()
 {
-    Obj *previous = NULL;
-    Obj *object = vm.objects;
-    while (object != NULL)
+    for (Obj *object = vm.objects; object != NULL; object = object->next)
     {
-        if (object->isMarked)
+        if (!object->isMarked && object->type == OBJ_FUNCTION)
+            recordFunctionCount((ObjFunction *)object);
+    }
+}
+#endif
+
+// Sweeps the next old object: frees it if it wasn't reached, otherwise unmarks it and puts it back on the list
+// of old objects.
+static void sweepNext()
+{
+    Obj *object = vm.sweeping;
+    vm.sweeping = object->next;
+    if (object->isMarked)
+    {
+        object->isMarked = false;
+        object->next = vm.objects;
+        vm.objects = object;
+    }
+    else
+    {
+        freeObject(object);
+    }
+}
+
+// Drops remembered objects that are about to be swept.
+static void forgetUnmarked()
+{
+    int kept = 0;
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        if (vm.remembered[i]->isMarked)
+            vm.remembered[kept++] = vm.remembered[i];
+    }
+    vm.rememberedCount = kept;
+}
+
+// Marks everything the nursery refers to. A full collection doesn't trace young objects one by one; the next
+// young collection sorts out which of them live, and until then they all count as roots.
+static void markNursery()
+{
+    for (uint8_t *at = vm.nursery; at < vm.nurseryTop;)
+    {
+        Obj *object = (Obj *)at;
+        blackenObject(&vm.gray, object);
+        at += NURSERY_ALIGN(objectSize(object));
+    }
+}
+
+#ifdef CONCURRENT_GC
+// The background marker. With --gc-concurrent, a collection marks the roots and whatever the nursery refers to
+// on run()'s thread, then hands those objects to a thread that traces the rest of the old generation while run()
+// carries on. The marker only reads objects and their isMarked flags, and only follows pointers to old objects,
+// none of which are freed or moved until marking is over. run() keeps changing the heap underneath it, so marking
+// works from a snapshot of the heap as it was when marking began: overwriteBarrier() marks any reference into
+// the old generation that is about to be overwritten, and objects allocated in the meantime start out marked.
+// Everything the mutator can reach later was either reachable then or allocated since, so nothing live is missed
+// and the roots needn't be marked again at the end. What the barriers mark goes on vm.gray; each slice hands it
+// over through a queue, and marking is done once the marker has run out of work and run() has none to hand over.
+static struct
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    bool running;    // A marker thread has been started and not yet joined.
+    GrayStack queue; // Objects handed over by run(), for the marker to take. Guarded by lock, as are the rest.
+    bool idle;       // The marker has nothing left to blacken.
+    bool stopping;   // The marker should exit once the queue is empty.
+} marker = {.lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER};
+
+// The marker thread. It swaps its empty gray stack for the queue and blackens everything on it, until told to
+// stop.
+static void *runMarker(void *unused)
+{
+    GrayStack gray = {0, 0, NULL};
+    pthread_mutex_lock(&marker.lock);
+    for (;;)
+    {
+        while (marker.queue.count == 0 && !marker.stopping)
         {
-            // Unmark the object for the next GC cycle.
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
+            marker.idle = true;
+            pthread_cond_wait(&marker.wake, &marker.lock);
         }
-        else
+        if (marker.queue.count == 0)
+            break;
+
+        GrayStack work = marker.queue;
+        marker.queue = gray;
+        marker.idle = false;
+        pthread_mutex_unlock(&marker.lock);
+
+        while (work.count > 0)
+            blackenObject(&work, work.objects[--work.count]);
+        gray = work;
+        pthread_mutex_lock(&marker.lock);
+    }
+    pthread_mutex_unlock(&marker.lock);
+    free(gray.objects);
+    return NULL;
+}
+
+// Hands what run() has marked since the last call over to the marker. Returns whether marking is done: the
+// marker was out of work and there was nothing to hand over.
+static bool handOverGray()
+{
+    pthread_mutex_lock(&marker.lock);
+    for (int i = 0; i < vm.gray.count; i++)
+        pushGray(&marker.queue, vm.gray.objects[i]);
+    vm.gray.count = 0;
+
+    bool done = marker.idle && marker.queue.count == 0;
+    if (!done)
+        pthread_cond_signal(&marker.wake);
+    pthread_mutex_unlock(&marker.lock);
+    return done;
+}
+
+// Starts a marker thread on the objects marked so far. Signals are blocked on it, so the profiler's SIGPROF is
+// only ever handled on run()'s thread.
+static void startMarker()
+{
+    marker.idle = false;
+    marker.stopping = false;
+    handOverGray();
+
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&marker.thread, NULL, runMarker, NULL) != 0)
+        exit(1);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    marker.running = true;
+}
+
+// Waits for the marker to blacken everything handed to it and exit.
+static void stopMarker()
+{
+    pthread_mutex_lock(&marker.lock);
+    marker.stopping = true;
+    pthread_cond_signal(&marker.wake);
+    pthread_mutex_unlock(&marker.lock);
+    pthread_join(marker.thread, NULL);
+    marker.running = false;
+}
+#endif
+
+// Ends marking in one go. Without the background marker, stores to the stack and to globals have no write
+// barrier and the nursery changes under the marker, so these are marked again before the gray stack is drained
+// for the last time. Everything left unmarked then is garbage, and the old objects are moved to a list of their
+// own to be swept; survivors, and objects allocated in the meantime, go on vm.objects.
+static void finishMarking()
+{
+#ifdef CONCURRENT_GC
+    if (marker.running)
+        stopMarker();
+    else
+#endif
+    {
+        markRoots();
+        markNursery();
+    }
+    traceReferences();
+    tableRemoveWhite(&vm.strings); // Removes unreachable strings.
+    forgetUnmarked();              // Drops unreachable objects from the remembered set.
+#ifdef DEBUG_COUNT_OPCODES
+    recordUnmarkedFunctions();
+#endif
+
+    vm.sweeping = vm.objects;
+    vm.objects = NULL;
+    vm.gcPhase = GC_SWEEP;
+}
+
+static void finishCycle()
+{
+    vm.gcPhase = GC_IDLE;
+    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR; // Sets the next GC threshold.
+}
+
+// One slice of an incremental collection of the old generation, starting one if none is in progress. It marks
+// or sweeps an object at a time until the pause budget is used up or the collection is done. Only the step
+// between marking and sweeping (finishMarking()) can't be split up; it takes time in proportion to the roots,
+// the nursery and the string table rather than to the heap. With the background marker, a slice only hands it
+// work until it is done marking; without a pause budget, the sweep then runs in one go.
+//
+// The mutator keeps running between slices, so stores into objects go through writeBarrier(), which marks the
+// value stored while marking is under way. Objects allocated in the old generation meanwhile start out marked.
+static void collectSlice()
+{
+    uint64_t start = nanoseconds();
+    uint64_t deadline = vm.gcPauseBudget > 0 ? start + (uint64_t)vm.gcPauseBudget * 1000 : UINT64_MAX;
+
+    if (vm.gcPhase == GC_IDLE)
+    {
+        markRoots();
+#ifdef CONCURRENT_GC
+        if (vm.gcConcurrent)
         {
-            // Free the object and remove it from the list.
-            Obj *unreached = object;
-            object = object->next;
-            if (previous != NULL)
+            markNursery(); // The marker's snapshot includes what young objects refer to.
+            startMarker();
+        }
+#endif
+        vm.gcPhase = GC_MARK;
+    }
+
+    for (int work = 1; vm.gcPhase != GC_IDLE; work++)
+    {
+        if (work % GC_CLOCK_STRIDE == 0 && nanoseconds() >= deadline)
+            break;
+
+        if (vm.gcPhase == GC_MARK)
+        {
+#ifdef CONCURRENT_GC
+            if (marker.running)
             {
-                previous->next = object;
+                if (!handOverGray())
+                    break; // run() carries on while the marker works.
+                finishMarking();
+                continue;
             }
+#endif
+            if (vm.gray.count > 0)
+                blackenObject(&vm.gray, vm.gray.objects[--vm.gray.count]);
             else
-            {
-                vm.objects = object;
-            }
-            freeObject(unreached);
+                finishMarking();
+        }
+        else if (vm.sweeping != NULL)
+        {
+            sweepNext();
+        }
+        else
+        {
+            finishCycle();
         }
     }
+
+    vm.nextSlice = vm.bytesAllocated + GC_SLICE_BYTES;
+    setNurseryLimit();
+    recordPause(start, PAUSE_SLICE);
 }
 
-// Frees all objects in the VM when shutting down.
-void freeObjects()
+// Whether collections of the old generation run alongside the program: with a pause budget or the background
+// marker, and only inside run(), where the nursery is open.
+static bool collectingInBackground()
+{
+    return (vm.gcPauseBudget > 0 || vm.gcConcurrent) && vm.nurseryOpen;
+}
+
+// Runs whatever collection of the old generation is due. Outside the background, a collection runs to
+// completion, including one still in progress from run(). If allocation outpaces the slices and the heap doubles
+// past the threshold a collection started at, the rest of it is done at once.
+static void collectIfDue()
+{
+    if (!collectingInBackground())
+    {
+        if (vm.gcPhase != GC_IDLE || vm.bytesAllocated > vm.nextGC)
+            collectGarbage();
+    }
+    else if (vm.gcPhase != GC_IDLE && vm.bytesAllocated > vm.nextGC * GC_HEAP_GROW_FACTOR)
+    {
+        collectGarbage();
+    }
+    else if (vm.gcPhase == GC_IDLE ? vm.bytesAllocated > vm.nextGC : vm.bytesAllocated > vm.nextSlice)
+    {
+        collectSlice();
+    }
+}
+
+// Returns the point past which the nursery counts as full.
+static uint8_t *nurseryFull()
+{
+#ifdef DEBUG_STRESS_GC
+    return vm.nursery; // A young collection at every safepoint.
+#else
+    return vm.nursery + NURSERY_SIZE - NURSERY_SLACK;
+#endif
+}
+
+// Sets the point past which run() calls collectAtSafepoint(): once the nursery is full, or while an incremental
+// collection is in progress, once another GC_SLICE_BYTES have been allocated in it, so that allocating young
+// objects paces the slices as well as allocating old ones.
+void setNurseryLimit()
+{
+    vm.nurseryLimit = nurseryFull();
+    if (vm.gcPhase != GC_IDLE && vm.nurseryTop + GC_SLICE_BYTES < vm.nurseryLimit)
+        vm.nurseryLimit = vm.nurseryTop + GC_SLICE_BYTES;
+}
+
+// Called from run()'s safepoints once the nursery passes vm.nurseryLimit.
+void collectAtSafepoint()
+{
+    if (vm.nurseryTop > nurseryFull() || vm.gcPhase == GC_IDLE)
+        collectYoung();
+    else
+        collectSlice();
+}
+
+#ifdef DEBUG_STRESS_GC
+// Collects on every allocation: a slice when collecting in the background, a whole collection otherwise.
+static void stressCollector()
+{
+    if (collectingInBackground())
+        collectSlice();
+    else
+        collectGarbage();
+}
+#endif
+
+// Returns where a young object lives once this young collection is done, copying it to the old generation the
+// first time it is reached. Old objects stay where they are.
+static Obj *promote(Obj *object)
+{
+    if (object == NULL || !isYoung(object))
+        return object;
+    if (object->next != NULL)
+        return object->next; // Already copied.
+
+    size_t size = objectSize(object);
+    vm.bytesAllocated += size;
+    Obj *copy = (Obj *)malloc(size);
+    if (copy == NULL)
+        exit(1);
+    memcpy(copy, object, size);
+    copy->isMarked = false;
+    copy->isRemembered = false;
+    copy->next = vm.objects;
+    vm.objects = copy;
+
+    // A closed upvalue points at its own closed field, which has moved with it.
+    if (object->type == OBJ_UPVALUE && ((ObjUpvalue *)object)->location == &((ObjUpvalue *)object)->closed)
+        ((ObjUpvalue *)copy)->location = &((ObjUpvalue *)copy)->closed;
+
+    object->next = copy;
+    pushGray(&vm.gray, copy);
+    return copy;
+}
+
+static void promoteValue(Value *slot)
+{
+    if (IS_OBJ(*slot))
+        STORE_REFERENCE(*slot, OBJ_VAL(promote(AS_OBJ(*slot))));
+}
+
+// Promotes whatever an object refers to and points it at the copies.
+static void promoteReferences(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        STORE_REFERENCE(closure->function, (ObjFunction *)promote((Obj *)closure->function));
+        for (int i = 0; i < closure->upvalueCount; i++)
+            STORE_REFERENCE(closure->upvalues[i], (ObjUpvalue *)promote((Obj *)closure->upvalues[i]));
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        STORE_REFERENCE(function->name, (ObjString *)promote((Obj *)function->name));
+        for (int i = 0; i < function->chunk.constants.count; i++)
+            promoteValue(&function->chunk.constants.values[i]);
+        break;
+    }
+    case OBJ_UPVALUE:
+        promoteValue(&((ObjUpvalue *)object)->closed);
+        break;
+    case OBJ_NATIVE:
+        STORE_REFERENCE(((ObjNative *)object)->name, (ObjString *)promote((Obj *)((ObjNative *)object)->name));
+        break;
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        STORE_REFERENCE(rope->left, promote(rope->left));
+        STORE_REFERENCE(rope->right, promote(rope->right));
+        STORE_REFERENCE(rope->flat, (ObjString *)promote((Obj *)rope->flat));
+        break;
+    }
+    case OBJ_STRING:
+        break;
+    }
+}
+
+// Young collection. Copies every young object reachable from the roots or the remembered set into the old
+// generation and empties the nursery. References are updated as objects move, so this may only run where no C
+// code holds a pointer to a young object: at run()'s safepoints, and once run() has returned.
+//
+// Open upvalues are reached through the VM's list of them rather than through each other, so an old open
+// upvalue linking to a young one needs no barrier. Globals have card marks instead of a remembered set: stores
+// to a global from run() or native code set its byte, and only the marked slots are looked at here. Interned
+// strings are weak, as in a full collection: the nursery is walked afterwards and every young string is either
+// renamed to its copy in vm.strings or dropped from it.
+void collectYoung()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- young collection begin\n");
+    size_t before = vm.bytesAllocated;
+#endif
+    uint64_t start = nanoseconds();
+    int marking = vm.gray.count; // Gray objects below this belong to an incremental collection.
+
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+        promoteValue(slot);
+    for (int i = 0; i < vm.frameCount; i++)
+        vm.frames[i].closure = (ObjClosure *)promote((Obj *)vm.frames[i].closure);
+    for (ObjUpvalue **link = &vm.openUpvalues; *link != NULL; link = &(*link)->next)
+        *link = (ObjUpvalue *)promote((Obj *)*link);
+
+    for (int i = 0; i < vm.globalValues.count; i++)
+    {
+        if (vm.globalCards[i])
+        {
+            promoteValue(&vm.globalValues.values[i]);
+            vm.globalCards[i] = 0;
+        }
+    }
+
+    for (int i = 0; i < vm.rememberedCount; i++)
+    {
+        promoteReferences(vm.remembered[i]);
+        vm.remembered[i]->isRemembered = false;
+    }
+    vm.rememberedCount = 0;
+
+    // The copies are scanned in turn; the gray stack serves as the worklist.
+    while (vm.gray.count > marking)
+        promoteReferences(vm.gray.objects[--vm.gray.count]);
+
+    // If a full collection is marking, the copies are marked too: the nursery it counts as roots is going away.
+    for (uint8_t *at = vm.nursery; at < vm.nurseryTop;)
+    {
+        Obj *object = (Obj *)at;
+        if (vm.gcPhase == GC_MARK && object->next != NULL)
+            markObject(object->next);
+        if (object->type == OBJ_STRING)
+        {
+            if (object->next != NULL)
+                tableReplaceKey(&vm.strings, (ObjString *)object, (ObjString *)object->next);
+            else
+                tableDelete(&vm.strings, (ObjString *)object);
+        }
+        at += NURSERY_ALIGN(objectSize(object));
+    }
+
+#ifdef DEBUG_STRESS_GC
+    memset(vm.nursery, 0xAB, vm.nurseryTop - vm.nursery); // Anything still pointing in here reads garbage.
+#endif
+    vm.nurseryTop = vm.nursery;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- young collection end\n");
+    printf("   promoted %zu bytes\n", vm.bytesAllocated - before);
+#endif
+    recordPause(start, PAUSE_YOUNG);
+
+    setNurseryLimit();
+    collectIfDue();
+}
+
+static void freeList(Obj *object)
 {
-    Obj *object = vm.objects;
     while (object != NULL)
     {
         Obj *next = object->next;
         freeObject(object);
         object = next;
     }
-    free(vm.grayStack);
 }
 
-// Main function for garbage collection.
+// Frees all objects in the VM when shutting down.
+void freeObjects()
+{
+#ifdef DEBUG_COUNT_OPCODES
+    recordUnmarkedFunctions(); // Survivors of the last collection are all unmarked again.
+#endif
+    freeList(vm.objects);
+    freeList(vm.sweeping);
+    free(vm.gray.objects);
+#ifdef CONCURRENT_GC
+    free(marker.queue.objects);
+#endif
+    free(vm.remembered);
+    free(vm.nursery);
+}
+
+// Collects the old generation without stopping: a whole collection, or the rest of an incremental one.
 void collectGarbage()
 {
 #ifdef DEBUG_LOG_GC
     printf("-- garbage collection begin\n");
     size_t before = vm.bytesAllocated;
 #endif
+    uint64_t start = nanoseconds();
 
-    markRoots();                   // Marks all the root objects.
-    traceReferences();             // Traces and marks all reachable objects.
-    tableRemoveWhite(&vm.strings); // Removes unreachable strings.
-    sweep();                       // Frees all unreachable objects.
-
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR; // Sets the next GC threshold.
+    if (vm.gcPhase != GC_SWEEP)
+        finishMarking(); // Marks all reachable objects, starting from the roots.
+    while (vm.sweeping != NULL)
+        sweepNext(); // Frees all unreachable old objects.
+    finishCycle();
+    setNurseryLimit();
+    recordPause(start, PAUSE_FULL);
 
 #ifdef DEBUG_LOG_GC
     printf("-- garbage collection end\n");
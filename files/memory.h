@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "object.h"
+#include "vm.h"
 
 #define ALLOCATE(type, count) \
     (type *)reallocate(NULL, 0, sizeof(type) * (count))
@@ -19,10 +20,73 @@
 #define FREE_ARRAY(type, pointer, oldCount) \
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
+// The young generation. While run() is executing, small objects are bump-allocated in a fixed block, the
+// nursery. Once it passes NURSERY_SIZE - NURSERY_SLACK, the next safepoint in run() copies the objects still
+// reachable into the old generation and empties it. The slack is there for the allocations an instruction
+// makes before it gets to that safepoint.
+#define NURSERY_SIZE (1024 * 1024)
+#define NURSERY_SLACK (64 * 1024)
+#define LARGE_OBJECT_SIZE 4096 // Bigger objects always go straight to the old generation.
+
 void *reallocate(void *pointer, size_t oldSize, size_t newSize);
+Obj *allocateYoung(size_t size);
+void rememberObject(Obj *object);
 void markObject(Obj *object);
 void markValue(Value value);
+void setNurseryLimit();
+void collectYoung();
+void collectAtSafepoint();
 void collectGarbage();
 void freeObjects();
+void startGcStats();
+void printGcStats();
+
+// Whether the object is in the nursery.
+static inline bool isYoung(Obj *object)
+{
+    return (uintptr_t)object - (uintptr_t)vm.nursery < NURSERY_SIZE;
+}
+
+// Access to a reference field of an object that the background marker may be blackening at the same time. The
+// marker reads with LOAD_REFERENCE() and run() writes with STORE_REFERENCE(), so neither sees half a value; the
+// store releases and the load acquires, so an object reached through the field is seen fully filled in. The
+// plain stores that fill in a new object need neither, as they come before the one that makes it reachable.
+#ifdef CONCURRENT_GC
+#define LOAD_REFERENCE(field) __atomic_load_n(&(field), __ATOMIC_ACQUIRE)
+#define STORE_REFERENCE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELEASE)
+#else
+#define LOAD_REFERENCE(field) (field)
+#define STORE_REFERENCE(field, value) ((field) = (value))
+#endif
+
+// Write barrier for storing value into a field of object. An old object that ends up pointing into the nursery
+// is remembered, so the next young collection finds that reference without scanning the old generation. While
+// an incremental collection is marking, an old value is marked, so no object the marker has finished with ends
+// up pointing to one it hasn't seen. (The background marker uses overwriteBarrier() instead.)
+static inline void writeBarrier(Obj *object, Value value)
+{
+    if (!IS_OBJ(value))
+        return;
+
+    if (isYoung(AS_OBJ(value)))
+    {
+        if (!object->isRemembered && !isYoung(object))
+            rememberObject(object);
+    }
+    else if (vm.gcPhase == GC_MARK && !vm.gcConcurrent)
+    {
+        markObject(AS_OBJ(value));
+    }
+}
+
+// Barrier for overwriting a reference held by object, called with the value about to be overwritten. While the
+// background marker is running, that value is marked, so everything that was reachable when marking began is
+// still found. Young objects need no such barrier: the marker starts out with everything they refer to. The
+// store that follows goes through STORE_REFERENCE().
+static inline void overwriteBarrier(Obj *object, Value previous)
+{
+    if (vm.gcPhase == GC_MARK && vm.gcConcurrent && IS_OBJ(previous) && !isYoung(object))
+        markObject(AS_OBJ(previous));
+}
 
 #endif
\ No newline at end of file
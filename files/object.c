@@ -1,6 +1,8 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
@@ -11,16 +13,25 @@
 #define ALLOCATE_OBJ(type, objectType) \
     (type *)allocateObject(sizeof(type), objectType)
 
-// Allocates memory for an object and initializes it.
+// Allocates memory for an object and initializes it. Small objects made while run() is executing go in the
+// nursery; everything else goes on the VM's list of old objects.
 static Obj *allocateObject(size_t size, ObjType type)
 {
-    Obj *object = (Obj *)reallocate(NULL, 0, size);
+    Obj *object = allocateYoung(size);
+    if (object == NULL)
+    {
+        object = (Obj *)reallocate(NULL, 0, size);
+        object->next = vm.objects;
+        vm.objects = object;
+    }
     object->type = type;
-    object->isMarked = false;
+    object->isMarked = vm.gcPhase == GC_MARK && !isYoung(object); // Allocated black while marking.
+    object->isRemembered = false;
 
-    // Adds the object to the VM's object list for tracking.
-    object->next = vm.objects;
-    vm.objects = object;
+    // An old object made while the nursery is open gets filled in with young objects without a write barrier,
+    // so it starts out remembered. Strings have nothing to remember.
+    if (vm.nurseryOpen && !isYoung(object) && type != OBJ_STRING)
+        rememberObject(object);
 
 #ifdef DEBUG_LOG_GC
     printf("%p allocated %zu for %d\n", (void *)object, size, type);
@@ -32,20 +43,18 @@ static Obj *allocateObject(size_t size, ObjType type)
 // Creates a new closure object.
 ObjClosure *newClosure(ObjFunction *function)
 {
-    // Allocate memory for upvalue references.
-    ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalueCount);
+    // Allocate the closure with its upvalue references stored after it, in one block.
+    size_t size = sizeof(ObjClosure) + sizeof(ObjUpvalue *) * function->upvalueCount;
+    ObjClosure *closure = (ObjClosure *)allocateObject(size, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
+    writeBarrier((Obj *)closure, OBJ_VAL(function));
 
     // Initialize upvalues to NULL.
     for (int i = 0; i < function->upvalueCount; i++)
     {
-        upvalues[i] = NULL;
+        closure->upvalues[i] = NULL;
     }
-
-    // Allocate and initialize a new closure object.
-    ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
-    closure->upvalues = upvalues;
-    closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
@@ -56,74 +65,175 @@ ObjFunction *newFunction()
     function->arity = 0;
     function->upvalueCount = 0;
     function->name = NULL;
+#ifdef BASELINE_JIT
+    function->hotness = 0;
+    function->jit = NULL;
+#endif
+#ifdef DEBUG_COUNT_OPCODES
+    function->instructionCount = 0;
+#endif
     initChunk(&function->chunk);
     return function;
 }
 
 // Creates a new native (C function) object.
-ObjNative *newNative(NativeFn function)
+ObjNative *newNative(NativeFn function, ObjString *name, int arity, uint8_t flags)
 {
     ObjNative *native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
     native->function = function;
+    native->name = name;
+    writeBarrier((Obj *)native, OBJ_VAL(name));
+    native->arity = arity;
+    native->flags = flags;
     return native;
 }
 
-// Allocates and initializes a new string object.
-static ObjString *allocateString(char *chars, int length, uint32_t hash)
+// Creates a rope joining two strings or ropes. Both must be reachable from the VM stack.
+ObjRope *newRope(Obj *left, Obj *right)
+{
+    ObjRope *rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+    rope->length = textLength(left) + textLength(right);
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    writeBarrier((Obj *)rope, OBJ_VAL(left));
+    writeBarrier((Obj *)rope, OBJ_VAL(right));
+    return rope;
+}
+
+// Returns the length of a string or rope.
+int textLength(Obj *text)
+{
+    return text->type == OBJ_STRING ? ((ObjString *)text)->length : ((ObjRope *)text)->length;
+}
+
+// Writes the characters of a string or rope to dest, which has room for all of them. The pieces are copied
+// from the back, following each rope's right half and keeping its left half for later; strings built by
+// appending in a loop are left-deep, so that stack stays short. It uses malloc rather than the collector's
+// allocator so it can run anywhere, including while a snapshot is written.
+void copyText(Obj *text, char *dest)
 {
-    ObjString *string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    int end = textLength(text);
+    Obj **pending = NULL;
+    int pendingCount = 0;
+    int pendingCapacity = 0;
+
+    for (;;)
+    {
+        while (text->type == OBJ_ROPE && ((ObjRope *)text)->flat == NULL)
+        {
+            if (pendingCount == pendingCapacity)
+            {
+                pendingCapacity = GROW_CAPACITY(pendingCapacity);
+                pending = realloc(pending, sizeof(Obj *) * pendingCapacity);
+                if (pending == NULL)
+                    exit(1);
+            }
+            pending[pendingCount++] = ((ObjRope *)text)->left;
+            text = ((ObjRope *)text)->right;
+        }
+
+        ObjString *string = text->type == OBJ_STRING ? (ObjString *)text : ((ObjRope *)text)->flat;
+        end -= string->length;
+        memcpy(dest + end, string->chars, string->length);
+
+        if (pendingCount == 0)
+            break;
+        text = pending[--pendingCount];
+    }
+    free(pending);
+}
+
+// Allocates a string object with room for length characters after its header. The caller fills them in.
+static ObjString *allocateString(int length)
+{
+    ObjString *string = (ObjString *)allocateObject(sizeof(ObjString) + length + 1, OBJ_STRING);
     string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+    string->chars[length] = '\0';
+    return string;
+}
 
-    // Adds string to the VM's string table for interning.
+// Adds a new string to the VM's string table for interning.
+static ObjString *internString(ObjString *string, uint32_t hash)
+{
+    string->hash = hash;
     push(OBJ_VAL(string));
     tableSet(&vm.strings, string, NIL_VAL);
     pop();
     return string;
 }
 
-// Hashes a string using the FNV-1a algorithm.
-static uint32_t hashString(const char *key, int length)
+// Looks up an interned string. While the old generation is being marked, one that had become garbage may not be
+// marked yet; handing it out again makes it live, so it is marked here rather than left for the marker to miss.
+static ObjString *findInterned(const char *chars, int length, uint32_t hash)
 {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; i++)
-    {
-        hash ^= (uint8_t)key[i];
-        hash *= 16777619;
-    }
-    return hash;
+    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL && vm.gcPhase == GC_MARK)
+        markObject((Obj *)interned);
+    return interned;
 }
 
-// Creates a new string object, reusing an existing one if found.
+// Creates a string object from a heap buffer the caller is done with, reusing an existing one if found. The
+// characters live inside the string object, so the buffer is freed either way.
 ObjString *takeString(char *chars, int length)
+{
+    ObjString *string = copyString(chars, length);
+    FREE_ARRAY(char, chars, length + 1);
+    return string;
+}
+
+// Creates a copy of a string and interns it.
+ObjString *copyString(const char *chars, int length)
 {
     uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString *interned = findInterned(chars, length, hash);
 
-    // If the string is already interned, free the new one and return the existing string.
     if (interned != NULL)
-    {
-        FREE_ARRAY(char, chars, length + 1);
         return interned;
-    }
 
-    return allocateString(chars, length, hash);
+    ObjString *string = allocateString(length);
+    memcpy(string->chars, chars, length);
+    return internString(string, hash);
 }
 
-// Creates a copy of a string and interns it.
-ObjString *copyString(const char *chars, int length)
+// Flattens a rope into an interned string and drops its halves, which may then be collected. The rope must be
+// reachable from the VM stack, since allocating the string can run a collection. The characters are written
+// straight into a new string object; if an equal string is interned already, the new one is given back, which
+// is safe because nothing has been allocated since: it is still at the top of the nursery or at the head of
+// vm.objects.
+ObjString *flattenRope(ObjRope *rope)
 {
-    uint32_t hash = hashString(chars, length);
-    ObjString *interned = tableFindString(&vm.strings, chars, length, hash);
+    if (rope->flat != NULL)
+        return rope->flat;
 
+    ObjString *string = allocateString(rope->length);
+    copyText((Obj *)rope, string->chars);
+    uint32_t hash = hashString(string->chars, string->length);
+    ObjString *interned = findInterned(string->chars, string->length, hash);
     if (interned != NULL)
-        return interned;
+    {
+        if (isYoung((Obj *)string))
+        {
+            vm.nurseryTop = (uint8_t *)string;
+        }
+        else
+        {
+            vm.objects = string->obj.next;
+            reallocate(string, sizeof(ObjString) + string->length + 1, 0);
+        }
+        STORE_REFERENCE(rope->flat, interned);
+    }
+    else
+    {
+        STORE_REFERENCE(rope->flat, internString(string, hash));
+    }
+    writeBarrier((Obj *)rope, OBJ_VAL(rope->flat));
 
-    char *heapChars = ALLOCATE(char, length + 1);
-    memcpy(heapChars, chars, length);
-    heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    overwriteBarrier((Obj *)rope, OBJ_VAL(rope->left));
+    overwriteBarrier((Obj *)rope, OBJ_VAL(rope->right));
+    STORE_REFERENCE(rope->left, NULL);
+    STORE_REFERENCE(rope->right, NULL);
+    return rope->flat;
 }
 
 // Creates a new upvalue object.
@@ -162,6 +272,23 @@ void printObject(Value value)
     case OBJ_NATIVE:
         printf("<native fn>");
         break;
+    case OBJ_ROPE:
+    {
+        // Printed without flattening, so printing from compiled code can't run a collection.
+        ObjRope *rope = AS_ROPE(value);
+        if (rope->flat != NULL)
+        {
+            printf("%s", rope->flat->chars);
+            break;
+        }
+        char *chars = malloc(rope->length);
+        if (chars == NULL)
+            exit(1);
+        copyText((Obj *)rope, chars);
+        fwrite(chars, 1, rope->length, stdout);
+        free(chars);
+        break;
+    }
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
         break;
@@ -12,12 +12,15 @@
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_TEXT(value) (IS_STRING(value) || IS_ROPE(value)) // Either kind of string value.
 
 // Macros to cast a Value to a specific object type.
 #define AS_CLOSURE(value) ((ObjClosure *)AS_OBJ(value))
 #define AS_FUNCTION(value) ((ObjFunction *)AS_OBJ(value))
-#define AS_NATIVE(value) (((ObjNative *)AS_OBJ(value))->function)
+#define AS_NATIVE(value) ((ObjNative *)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope *)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 
@@ -28,17 +31,24 @@ typedef enum
     OBJ_FUNCTION,
     OBJ_NATIVE,
     OBJ_STRING,
-    OBJ_UPVALUE
+    OBJ_UPVALUE,
+    OBJ_ROPE
 } ObjType;
 
 // Base structure for all objects.
 struct Obj
 {
-    ObjType type;     // Type of the object.
-    bool isMarked;    // Used for garbage collection.
-    struct Obj *next; // Next object in the list of all objects.
+    ObjType type;      // Type of the object.
+    bool isMarked;     // Used for garbage collection.
+    bool isRemembered; // An old object in the remembered set (see memory.c).
+    struct Obj *next;  // Next object in the list of all objects. For a young object, NULL until a young
+                       // collection copies it out, then the copy.
 };
 
+#ifdef BASELINE_JIT
+typedef struct JitCode JitCode;
+#endif
+
 // Structure for a function object.
 typedef struct
 {
@@ -47,16 +57,35 @@ typedef struct
     int upvalueCount; // Number of upvalues the function has.
     Chunk chunk;      // Chunk holding the function's bytecode.
     ObjString *name;  // Function's name.
+#ifdef BASELINE_JIT
+    int hotness;      // Calls and loop back-edges run so far, until the function is compiled.
+    JitCode *jit;     // Native code, or NULL while the function is interpreted.
+#endif
+#ifdef DEBUG_COUNT_OPCODES
+    uint64_t instructionCount; // Instructions run() has dispatched for this function.
+#endif
 } ObjFunction;
 
-// Native function pointer type.
-typedef Value (*NativeFn)(int argCount, Value *args);
+// Native function pointer type. A native stores its return value in *result and returns true, or reports a
+// runtime error with nativeError() and returns false.
+typedef bool (*NativeFn)(int argCount, Value *args, Value *result);
+
+// Properties a native declares when it is defined.
+typedef enum
+{
+    NATIVE_PURE = 1 << 0,      // No side effects; the result depends only on the arguments.
+    NATIVE_ALLOCATES = 1 << 1, // May allocate, so a collection can run during the call. Compiled code leaves
+                               // calls to these to run(), where the collector is safe to run.
+} NativeFlags;
 
 // Structure for a native (C function) object.
 typedef struct
 {
     Obj obj;           // Base object.
     NativeFn function; // Pointer to the native C function.
+    ObjString *name;   // Name the native was defined under.
+    int arity;         // Number of arguments it takes, or -1 for any number.
+    uint8_t flags;     // NativeFlags.
 } ObjNative;
 
 // Structure for a string object.
@@ -64,10 +93,26 @@ struct ObjString
 {
     Obj obj;       // Base object.
     int length;    // Length of the string.
-    char *chars;   // Pointer to the character data.
     uint32_t hash; // Hash value of the string.
+    char chars[];  // The characters and a terminating NUL, stored in the same block after the header.
 };
 
+// Concatenations shorter than this are copied into a new string right away; longer ones make a rope.
+#define ROPE_MIN_LENGTH 64
+
+// Structure for a rope: the result of concatenating two strings or ropes, kept as its two halves so that
+// building a long string one piece at a time doesn't copy everything built so far on every step. A rope is
+// flattened into an interned string the first time something needs it as one (an equality test); after
+// that it only forwards to the string.
+typedef struct
+{
+    Obj obj;         // Base object.
+    int length;      // Length of the whole string.
+    Obj *left;       // First half, an ObjString or ObjRope. NULL once flattened.
+    Obj *right;      // Second half, likewise.
+    ObjString *flat; // The flattened string, or NULL.
+} ObjRope;
+
 // Structure for an upvalue object.
 typedef struct ObjUpvalue
 {
@@ -80,16 +125,20 @@ typedef struct ObjUpvalue
 // Structure for a closure object.
 typedef struct
 {
-    Obj obj;               // Base object.
-    ObjFunction *function; // Pointer to the function object.
-    ObjUpvalue **upvalues; // Array of upvalue pointers.
-    int upvalueCount;      // Number of upvalues.
+    Obj obj;                // Base object.
+    ObjFunction *function;  // Pointer to the function object.
+    int upvalueCount;       // Number of upvalues.
+    ObjUpvalue *upvalues[]; // Upvalue pointers, stored in the same block after the header.
 } ObjClosure;
 
 // Function declarations for creating new objects.
 ObjClosure *newClosure(ObjFunction *function);
 ObjFunction *newFunction();
-ObjNative *newNative(NativeFn function);
+ObjNative *newNative(NativeFn function, ObjString *name, int arity, uint8_t flags);
+ObjRope *newRope(Obj *left, Obj *right);
+ObjString *flattenRope(ObjRope *rope);
+int textLength(Obj *text);
+void copyText(Obj *text, char *dest);
 ObjString *takeString(char *chars, int length);
 ObjString *copyString(const char *chars, int length);
 ObjUpvalue *newUpvalue(Value *slot);
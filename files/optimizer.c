@@ -0,0 +1,509 @@
+#include <string.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "optimizer.h"
+
+// Describes a superinstruction: the opcode sequence it replaces.
+typedef struct
+{
+    uint8_t fused;       // The superinstruction's opcode.
+    int length;          // Number of instructions in the sequence.
+    uint8_t sequence[5]; // The original opcodes, in order.
+} Superinstruction;
+
+// The fused set. These are the most frequent sequences reported by `npa --op-pairs` over our scripts:
+// loop conditions, `i = i + 1` style increments, and the OP_POP that ends every expression statement and
+// every branch of a conditional. Longer sequences come first so they win over their prefixes.
+static const Superinstruction superinstructions[] = {
+    {OP_LESS_LOCAL_CONSTANT_JUMP, 5, {OP_GET_LOCAL, OP_CONSTANT, OP_LESS, OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_ADD_LOCALS, 3, {OP_GET_LOCAL, OP_GET_LOCAL, OP_ADD}},
+    {OP_ADD_LOCAL_CONSTANT, 3, {OP_GET_LOCAL, OP_CONSTANT, OP_ADD}},
+    {OP_JUMP_IF_FALSE_POP, 2, {OP_JUMP_IF_FALSE, OP_POP}},
+    {OP_SET_LOCAL_POP, 2, {OP_SET_LOCAL, OP_POP}},
+    {OP_SET_GLOBAL_POP, 2, {OP_SET_GLOBAL, OP_POP}},
+};
+
+#define SUPERINSTRUCTION_COUNT (int)(sizeof(superinstructions) / sizeof(superinstructions[0]))
+
+// Returns the opcode sequence a superinstruction stands for, or NULL if the instruction is not fused.
+const uint8_t *fusedSequence(uint8_t instruction, int *length)
+{
+    for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++)
+    {
+        if (superinstructions[i].fused == instruction)
+        {
+            *length = superinstructions[i].length;
+            return superinstructions[i].sequence;
+        }
+    }
+    return NULL;
+}
+
+// Marks every offset that some jump or loop instruction lands on.
+static bool *findJumpTargets(Chunk *chunk)
+{
+    bool *targets = ALLOCATE(bool, chunk->count + 1);
+    for (int i = 0; i <= chunk->count; i++)
+        targets[i] = false;
+
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction != OP_JUMP && instruction != OP_JUMP_IF_FALSE && instruction != OP_LOOP)
+            continue;
+
+        int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        targets[offset + 3 + (instruction == OP_LOOP ? -jump : jump)] = true;
+    }
+
+    return targets;
+}
+
+// Returns where the jump or loop instruction at offset lands.
+static int jumpTarget(Chunk *chunk, int offset)
+{
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return offset + 3 + (chunk->code[offset] == OP_LOOP ? -jump : jump);
+}
+
+// Follows a jump through any jumps it lands on. OP_JUMP_IF_FALSE leaves its condition on the stack, so a
+// conditional jump that lands on another one with the same outcome can take that one's target too; it has
+// to stay a forward jump though. Every hop keeps within the 16-bit range measured on the original offsets,
+// which compaction only ever shortens.
+static int threadJump(Chunk *chunk, int offset)
+{
+    bool conditional = chunk->code[offset] == OP_JUMP_IF_FALSE;
+    int target = jumpTarget(chunk, offset);
+
+    for (int hops = 0; hops < 8; hops++)
+    {
+        uint8_t next = chunk->code[target];
+        if (next != OP_JUMP && next != OP_LOOP && !(conditional && next == OP_JUMP_IF_FALSE))
+            break;
+
+        int further = jumpTarget(chunk, target);
+        int distance = further - (offset + 3);
+        if ((conditional && distance < 0) || distance > UINT16_MAX || -distance > UINT16_MAX)
+            break;
+        target = further;
+    }
+    return target;
+}
+
+// Collects where control can go after an instruction whose opcode is instruction; returns how many places.
+static int findSuccessors(Chunk *chunk, uint8_t instruction, int offset, int *successors)
+{
+    int count = 0;
+    if (instruction != OP_JUMP && instruction != OP_LOOP && instruction != OP_RETURN)
+        successors[count++] = offset + opcodeLength(chunk, instruction, offset);
+    if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+    {
+        int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        successors[count++] = offset + 3 + (instruction == OP_LOOP ? -jump : jump);
+    }
+    return count;
+}
+
+// Works out the stack height before every instruction, counted from the frame's slot 0, or -1 where no path
+// from the entry leads. The compiler gives an instruction the same height on every path to it.
+static int *findStackHeights(Chunk *chunk, int arity)
+{
+    int *heights = ALLOCATE(int, chunk->count);
+    int *worklist = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        heights[i] = -1;
+
+    int pending = 0;
+    heights[0] = arity + 1; // The callee and its arguments.
+    worklist[pending++] = 0;
+    while (pending > 0)
+    {
+        int offset = worklist[--pending];
+        int popped;
+        int pushed;
+        stackEffect(chunk, chunk->code[offset], offset, &popped, &pushed);
+
+        int successors[2];
+        int successorCount = findSuccessors(chunk, chunk->code[offset], offset, successors);
+        for (int i = 0; i < successorCount; i++)
+        {
+            if (successors[i] < chunk->count && heights[successors[i]] < 0)
+            {
+                heights[successors[i]] = heights[offset] - popped + pushed;
+                worklist[pending++] = successors[i];
+            }
+        }
+    }
+
+    FREE_ARRAY(int, worklist, chunk->count);
+    return heights;
+}
+
+// Whether the OP_CLOSURE at offset captures the given local.
+static bool capturesLocal(Chunk *chunk, int offset, int slot)
+{
+    int length = opcodeLength(chunk, OP_CLOSURE, offset);
+    for (int i = 2; i < length; i += 2)
+    {
+        if (chunk->code[offset + i] && chunk->code[offset + i + 1] == slot)
+            return true;
+    }
+    return false;
+}
+
+// Follows the value the instruction at from leaves in stack slot `slot` along every path, up to whatever takes
+// it off the stack, and returns whether that is always an OP_POP, an OP_CLOSE_UPVALUE or an OP_CALL calling it.
+// Each OP_GET_LOCAL of the slot is a copy that is followed the same way, and assigning or capturing the slot
+// counts as an escape. copies remembers the answer for the copy each OP_GET_LOCAL makes (0 if not worked out
+// yet, 1 if it stays, 2 if not), so each one is followed once however many paths lead to it.
+static bool onlyCalled(Chunk *chunk, const uint8_t *opcodes, const int *heights, uint8_t *copies, int from, int slot)
+{
+    int count = chunk->count;
+    bool *queued = ALLOCATE(bool, count);
+    int *worklist = ALLOCATE(int, count);
+    for (int i = 0; i < count; i++)
+        queued[i] = false;
+
+    int successors[2];
+    int successorCount = findSuccessors(chunk, opcodes[from], from, successors);
+    int pending = 0;
+    bool stays = true;
+    for (;;)
+    {
+        for (int i = 0; stays && i < successorCount; i++)
+        {
+            int successor = successors[i];
+            if (successor < 0 || successor >= count || heights[successor] <= slot)
+            {
+                stays = false; // Only reachable if the value has gone without anything taking it.
+            }
+            else if (!queued[successor])
+            {
+                queued[successor] = true;
+                worklist[pending++] = successor;
+            }
+        }
+        if (!stays || pending == 0)
+            break;
+
+        int offset = worklist[--pending];
+        uint8_t instruction = opcodes[offset];
+        int height = heights[offset];
+        bool onSlot = (instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL) && chunk->code[offset + 1] == slot;
+        successorCount = 0;
+        if (instruction == OP_GET_LOCAL && onSlot)
+        {
+            // The copy can't lead back here: the stack would have to come down to it, taking it off first.
+            if (copies[offset] == 0)
+                copies[offset] = onlyCalled(chunk, opcodes, heights, copies, offset, height) ? 1 : 2;
+            stays = copies[offset] == 1;
+        }
+        else if (instruction == OP_SET_LOCAL && onSlot)
+        {
+            stays = false;
+        }
+        else if (instruction == OP_CLOSURE)
+        {
+            stays = !capturesLocal(chunk, offset, slot);
+        }
+        if (!stays)
+            break;
+
+        int popped;
+        int pushed;
+        stackEffect(chunk, instruction, offset, &popped, &pushed);
+        if (instruction != OP_JUMP_IF_FALSE && height - popped <= slot)
+        {
+            stays = instruction == OP_POP || instruction == OP_CLOSE_UPVALUE ||
+                    (instruction == OP_CALL && height - popped == slot);
+            continue;
+        }
+        successorCount = findSuccessors(chunk, instruction, offset, successors);
+    }
+
+    FREE_ARRAY(bool, queued, count);
+    FREE_ARRAY(int, worklist, count);
+    return stays;
+}
+
+// Whether the closure the instruction at offset leaves on the stack stays in the local it lands in and is only
+// ever called from there: never copied anywhere else, returned, passed as an argument, assigned over or
+// captured, and never the callee of an OP_TAIL_CALL, which would take this function's frame away. opcodes holds
+// the original opcode of each instruction (the chunk's own code before superinstructions are written over it)
+// and heights the stack height before each one, negative if it can't be reached.
+bool closureStaysLocal(Chunk *chunk, const uint8_t *opcodes, const int *heights, int offset)
+{
+    uint8_t *copies = ALLOCATE(uint8_t, chunk->count);
+    for (int i = 0; i < chunk->count; i++)
+        copies[i] = 0;
+    bool stays = onlyCalled(chunk, opcodes, heights, copies, offset, heights[offset]);
+    FREE_ARRAY(uint8_t, copies, chunk->count);
+    return stays;
+}
+
+// Whether the OP_CLOSURE at offset can do without an ObjClosure and ObjUpvalues of its own. It can if the closure
+// stays local and captures only locals of this function, which are then still there, below the local holding the
+// closure, whenever it is called. Every call comes from this function, so the function can reach those locals
+// through its caller's frame instead. Its own closures mustn't capture them in turn, since they may outlive it.
+static bool canLiftClosure(Chunk *chunk, const int *heights, int offset)
+{
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    if (heights[offset] < 0)
+        return false;
+    for (int i = 0; i < function->upvalueCount; i++)
+    {
+        if (!chunk->code[offset + 2 + 2 * i] || chunk->code[offset + 3 + 2 * i] >= heights[offset])
+            return false; // An enclosing function's variable, or the closure's own local.
+    }
+
+    Chunk *body = &function->chunk;
+    for (int at = 0; at < body->count; at += instructionLength(body, at))
+    {
+        if (body->code[at] != OP_CLOSURE)
+            continue;
+        int length = instructionLength(body, at);
+        for (int i = 2; i < length; i += 2)
+        {
+            if (!body->code[at + i])
+                return false;
+        }
+    }
+
+    return closureStaysLocal(chunk, chunk->code, heights, offset);
+}
+
+// Points a lifted function's upvalue instructions at the locals its closure would have captured, as listed by
+// the OP_CLOSURE at offset.
+static void liftUpvalues(Chunk *chunk, int offset)
+{
+    ObjFunction *function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+    Chunk *body = &function->chunk;
+    for (int at = 0; at < body->count; at += instructionLength(body, at))
+    {
+        uint8_t instruction = body->code[at];
+        if (instruction == OP_GET_UPVALUE || instruction == OP_SET_UPVALUE)
+        {
+            body->code[at] = instruction == OP_GET_UPVALUE ? OP_GET_CALLER_LOCAL : OP_SET_CALLER_LOCAL;
+            body->code[at + 1] = chunk->code[offset + 3 + 2 * body->code[at + 1]];
+        }
+    }
+}
+
+// Comparisons the compiler spells as the opposite comparison followed by OP_NOT.
+static uint8_t negatedComparison(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_EQUAL:
+        return OP_NOT_EQUAL;
+    case OP_LESS:
+        return OP_GREATER_EQUAL;
+    case OP_GREATER:
+        return OP_LESS_EQUAL;
+    default:
+        return 0;
+    }
+}
+
+// Peephole pass over a finished function, before fuseSuperinstructions(). It folds comparison-then-OP_NOT pairs
+// into single opcodes, threads jumps that land on jumps, drops instructions no path reaches (code after a
+// return, the implicit OP_NIL, OP_RETURN after an explicit one) and then compacts the chunk, moving line
+// numbers along with their instructions and re-encoding every jump for the new layout.
+//
+// It also lifts closures that never escape (see canLiftClosure()). Their functions get OP_GET_CALLER_LOCAL and
+// OP_SET_CALLER_LOCAL in place of upvalue access and lose their upvalues, and the OP_CLOSURE becomes an
+// OP_CONSTANT of one shared closure, like that of a function that captures nothing. Making such a closure then
+// allocates neither the closure nor upvalues.
+void optimizeChunk(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    bool *targets = findJumpTargets(chunk);
+    bool *removed = ALLOCATE(bool, count);
+    bool *reachable = ALLOCATE(bool, count);
+    bool *lifted = ALLOCATE(bool, count);
+    int *threaded = ALLOCATE(int, count);
+    int *worklist = ALLOCATE(int, count);
+    int *newOffsets = ALLOCATE(int, count + 1);
+    for (int i = 0; i < count; i++)
+    {
+        removed[i] = false;
+        reachable[i] = false;
+        lifted[i] = false;
+    }
+
+    // The lifted functions keep their upvalue count until the chunk is compacted, since the length of the
+    // OP_CLOSURE depends on it.
+    int *heights = findStackHeights(chunk, function->arity);
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset))
+    {
+        if (chunk->code[offset] == OP_CLOSURE && canLiftClosure(chunk, heights, offset))
+        {
+            liftUpvalues(chunk, offset);
+            lifted[offset] = true;
+        }
+    }
+    FREE_ARRAY(int, heights, count);
+
+    for (int offset = 0; offset < count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        uint8_t negated = negatedComparison(instruction);
+        if (negated != 0 && offset + 1 < count && chunk->code[offset + 1] == OP_NOT && !targets[offset + 1])
+        {
+            chunk->code[offset] = negated;
+            removed[offset + 1] = true;
+        }
+        else if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+        {
+            threaded[offset] = threadJump(chunk, offset);
+        }
+    }
+
+    // Marks the reachable instructions, following the threaded jumps.
+    int pending = 0;
+    worklist[pending++] = 0;
+    reachable[0] = true;
+    while (pending > 0)
+    {
+        int offset = worklist[--pending];
+        uint8_t instruction = chunk->code[offset];
+        int successors[2];
+        int successorCount = 0;
+
+        if (instruction == OP_JUMP || instruction == OP_LOOP)
+        {
+            successors[successorCount++] = threaded[offset];
+        }
+        else if (instruction != OP_RETURN)
+        {
+            successors[successorCount++] = offset + instructionLength(chunk, offset);
+            if (instruction == OP_JUMP_IF_FALSE)
+                successors[successorCount++] = threaded[offset];
+        }
+
+        for (int i = 0; i < successorCount; i++)
+        {
+            if (successors[i] < count && !reachable[successors[i]])
+            {
+                reachable[successors[i]] = true;
+                worklist[pending++] = successors[i];
+            }
+        }
+    }
+
+    // Compacts the surviving instructions in place. A dropped instruction maps to wherever the next surviving
+    // one ends up, so a jump that landed on it lands there instead. The old layout can't be walked once it has
+    // been overwritten, so the surviving jumps are collected on the way (reusing the worklist). The line table
+    // is rebuilt for the new offsets from a copy of the old one.
+    Chunk oldLines = *chunk;
+    chunk->lineCount = 0;
+    chunk->lineCapacity = 0;
+    chunk->lines = NULL;
+    int newCount = 0;
+    int jumpCount = 0;
+    for (int offset = 0; offset < count;)
+    {
+        int length = instructionLength(chunk, offset);
+        newOffsets[offset] = newCount;
+        if (reachable[offset] && !removed[offset])
+        {
+            uint8_t instruction = chunk->code[offset];
+            if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_LOOP)
+                worklist[jumpCount++] = offset;
+
+            int kept = lifted[offset] ? 2 : length; // The OP_CLOSURE's opcode and constant, minus the captures.
+            memmove(&chunk->code[newCount], &chunk->code[offset], kept);
+            if (lifted[offset])
+                chunk->code[newCount] = OP_CONSTANT;
+            addLine(chunk, newCount, getLine(&oldLines, offset));
+            newCount += kept;
+        }
+        for (int i = 1; i < length; i++)
+            newOffsets[offset + i] = newCount;
+        offset += length;
+    }
+    newOffsets[count] = newCount;
+
+    for (int i = 0; i < jumpCount; i++)
+    {
+        int offset = worklist[i];
+        int at = newOffsets[offset];
+        uint8_t instruction = chunk->code[at];
+        int jump = newOffsets[threaded[offset]] - (at + 3);
+        if (instruction != OP_JUMP_IF_FALSE)
+            chunk->code[at] = jump < 0 ? OP_LOOP : OP_JUMP;
+        if (jump < 0)
+            jump = -jump;
+        chunk->code[at + 1] = (jump >> 8) & 0xff;
+        chunk->code[at + 2] = jump & 0xff;
+    }
+    chunk->count = newCount;
+
+    // Each lifted function's constant becomes its shared closure. The function stays reachable through the
+    // constant until the closure replaces it.
+    for (int offset = 0; offset < newCount; offset += instructionLength(chunk, offset))
+    {
+        if (chunk->code[offset] != OP_CONSTANT)
+            continue;
+        Value *constant = &chunk->constants.values[chunk->code[offset + 1]];
+        if (!IS_FUNCTION(*constant))
+            continue;
+        ObjFunction *liftedFunction = AS_FUNCTION(*constant);
+        liftedFunction->upvalueCount = 0;
+        *constant = OBJ_VAL(newClosure(liftedFunction));
+    }
+
+    FREE_ARRAY(LineStart, oldLines.lines, oldLines.lineCapacity);
+    FREE_ARRAY(bool, targets, count + 1);
+    FREE_ARRAY(bool, removed, count);
+    FREE_ARRAY(bool, reachable, count);
+    FREE_ARRAY(bool, lifted, count);
+    FREE_ARRAY(int, threaded, count);
+    FREE_ARRAY(int, worklist, count);
+    FREE_ARRAY(int, newOffsets, count + 1);
+}
+
+// Checks whether the instructions starting at offset spell out a superinstruction's sequence, without any
+// jump landing in the middle of it.
+static bool matchesSequence(Chunk *chunk, bool *targets, int offset, const Superinstruction *super)
+{
+    for (int i = 0; i < super->length; i++)
+    {
+        if (offset >= chunk->count || chunk->code[offset] != super->sequence[i])
+            return false;
+        if (i > 0 && targets[offset])
+            return false;
+        offset += instructionLength(chunk, offset);
+    }
+    return true;
+}
+
+// Rewrites common instruction sequences into superinstructions so run() dispatches once per sequence.
+// Only the first opcode of a sequence is overwritten. The operands and the following opcodes stay where
+// they were, so no jump offsets or line numbers need fixing, and a handler that hits an unexpected operand
+// type can execute the first original instruction and carry on with the rest of the sequence unfused.
+void fuseSuperinstructions(Chunk *chunk)
+{
+    bool *targets = findJumpTargets(chunk);
+
+    int offset = 0;
+    while (offset < chunk->count)
+    {
+        int length = instructionLength(chunk, offset);
+        for (int i = 0; i < SUPERINSTRUCTION_COUNT; i++)
+        {
+            const Superinstruction *super = &superinstructions[i];
+            if (matchesSequence(chunk, targets, offset, super))
+            {
+                chunk->code[offset] = super->fused;
+                length = instructionLength(chunk, offset);
+                break;
+            }
+        }
+        offset += length;
+    }
+
+    FREE_ARRAY(bool, targets, chunk->count + 1);
+}
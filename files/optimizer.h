@@ -0,0 +1,12 @@
+#ifndef npa_optimizer_h
+#define npa_optimizer_h
+
+#include "chunk.h"
+#include "object.h"
+
+void optimizeChunk(ObjFunction *function);
+void fuseSuperinstructions(Chunk *chunk);
+const uint8_t *fusedSequence(uint8_t instruction, int *length);
+bool closureStaysLocal(Chunk *chunk, const uint8_t *opcodes, const int *heights, int offset);
+
+#endif
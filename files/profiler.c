@@ -0,0 +1,249 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "profiler.h"
+#include "vm.h"
+
+#ifdef SAMPLING_PROFILER
+
+// One frame of a sampled call stack.
+typedef struct
+{
+    ObjFunction *function;
+    int line;
+} SampleFrame;
+
+// A distinct call stack and how many samples landed on it. Its frames are stored innermost first.
+typedef struct
+{
+    uint32_t hash;
+    int start;      // Index of the innermost frame in the frame pool.
+    int depth;      // Number of frames kept.
+    bool truncated; // Whether outer frames were cut off at PROFILE_MAX_DEPTH.
+    unsigned long count;
+} SampleStack;
+
+// All profiler state is allocated up front: the signal handler can't call malloc, and the GC must not run
+// from inside it. Identical stacks are folded as they're sampled, so memory stays bounded however long the
+// script runs; samples that don't fit are only counted.
+typedef struct
+{
+    volatile sig_atomic_t active;
+    volatile sig_atomic_t paused;
+    const char *path;
+    SampleStack *stacks;
+    int stackCount;
+    SampleFrame *frames;
+    int frameCount;
+    unsigned long samples;
+    unsigned long dropped;
+} Profiler;
+
+static Profiler profiler;
+
+// Maps a frame's saved instruction pointer to a source line. run() keeps the innermost frame's ip in a
+// register and only writes it back at calls and loop back-edges, so that frame resolves to the line of the
+// most recent one; outer frames resolve to their call sites. A tail call can be caught between replacing
+// the closure and resetting ip, so out-of-range offsets are clamped rather than trusted.
+static int sampleLine(CallFrame *frame, ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0)
+        return 0;
+
+    ptrdiff_t offset = frame->ip - chunk->code - 1;
+    if (offset < 0 || offset >= chunk->count)
+        offset = 0;
+    return getLine(chunk, (int)offset);
+}
+
+static bool sameFrames(SampleStack *stack, SampleFrame *frames, int depth, bool truncated)
+{
+    if (stack->depth != depth || stack->truncated != truncated)
+        return false;
+
+    for (int i = 0; i < depth; i++)
+    {
+        SampleFrame *frame = &profiler.frames[stack->start + i];
+        if (frame->function != frames[i].function || frame->line != frames[i].line)
+            return false;
+    }
+    return true;
+}
+
+// The SIGPROF handler. It only reads vm.frames and writes into the preallocated tables.
+static void takeSample(int signal)
+{
+    (void)signal;
+    if (!profiler.active || profiler.paused || vm.frameCount == 0)
+        return;
+
+    SampleFrame frames[PROFILE_MAX_DEPTH];
+    int depth = 0;
+    uint32_t hash = 2166136261u;
+    for (int i = vm.frameCount - 1; i >= 0 && depth < PROFILE_MAX_DEPTH; i--)
+    {
+        ObjFunction *function = vm.frames[i].closure->function;
+        int line = sampleLine(&vm.frames[i], function);
+        frames[depth].function = function;
+        frames[depth].line = line;
+        depth++;
+
+        hash = (hash ^ (uint32_t)(uintptr_t)function) * 16777619u;
+        hash = (hash ^ (uint32_t)line) * 16777619u;
+    }
+    bool truncated = vm.frameCount > PROFILE_MAX_DEPTH;
+    profiler.samples++;
+
+    for (uint32_t index = hash & (PROFILE_STACKS - 1);; index = (index + 1) & (PROFILE_STACKS - 1))
+    {
+        SampleStack *stack = &profiler.stacks[index];
+        if (stack->count == 0)
+        {
+            // Keeps the table at most three quarters full so probing stays short.
+            if (profiler.stackCount >= PROFILE_STACKS / 4 * 3 || profiler.frameCount + depth > PROFILE_FRAMES)
+            {
+                profiler.dropped++;
+                return;
+            }
+
+            stack->hash = hash;
+            stack->start = profiler.frameCount;
+            stack->depth = depth;
+            stack->truncated = truncated;
+            for (int i = 0; i < depth; i++)
+                profiler.frames[profiler.frameCount++] = frames[i];
+            profiler.stackCount++;
+            stack->count = 1;
+            return;
+        }
+
+        if (stack->hash == hash && sameFrames(stack, frames, depth, truncated))
+        {
+            stack->count++;
+            return;
+        }
+    }
+}
+
+// Starts sampling the call stack every PROFILE_INTERVAL_US of CPU time. The samples are written to path as
+// collapsed stacks ("outer;inner count" per line, the input format of flamegraph.pl and similar tools) when
+// the profiler is stopped.
+bool startProfiler(const char *path)
+{
+    profiler.stacks = calloc(PROFILE_STACKS, sizeof(SampleStack));
+    profiler.frames = malloc(sizeof(SampleFrame) * PROFILE_FRAMES);
+    if (profiler.stacks == NULL || profiler.frames == NULL)
+    {
+        free(profiler.stacks);
+        free(profiler.frames);
+        return false;
+    }
+    profiler.path = path;
+
+    // SA_RESTART keeps reads in input() from failing with EINTR when a sample interrupts them.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = takeSample;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+        return false;
+
+    profiler.active = 1;
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL_US;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0)
+    {
+        profiler.active = 0;
+        return false;
+    }
+    return true;
+}
+
+static void writeFrame(FILE *file, SampleFrame *frame)
+{
+    if (frame->function->name == NULL)
+        fprintf(file, "script:%d", frame->line);
+    else
+        fprintf(file, "%s:%d", frame->function->name->chars, frame->line);
+}
+
+// Stops the timer and writes out the collapsed stacks. It has to run before the heap is freed, since the
+// sampled functions are only resolved to names here.
+void stopProfiler()
+{
+    if (!profiler.active)
+        return;
+
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    profiler.active = 0;
+    signal(SIGPROF, SIG_IGN);
+
+    FILE *file = fopen(profiler.path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "npa: could not write profile to \"%s\".\n", profiler.path);
+    }
+    else
+    {
+        for (int i = 0; i < PROFILE_STACKS; i++)
+        {
+            SampleStack *stack = &profiler.stacks[i];
+            if (stack->count == 0)
+                continue;
+
+            if (stack->truncated)
+                fprintf(file, "[truncated];");
+            for (int frame = stack->depth - 1; frame >= 0; frame--)
+            {
+                writeFrame(file, &profiler.frames[stack->start + frame]);
+                fputc(frame > 0 ? ';' : ' ', file);
+            }
+            fprintf(file, "%lu\n", stack->count);
+        }
+        fclose(file);
+    }
+
+    if (profiler.dropped > 0)
+        fprintf(stderr, "npa: profile dropped %lu of %lu samples; too many distinct stacks.\n", profiler.dropped,
+                profiler.samples);
+
+    free(profiler.stacks);
+    free(profiler.frames);
+    profiler.stacks = NULL;
+    profiler.frames = NULL;
+}
+
+// Suspends sampling while vm.frames is being reallocated; the handler would otherwise read the freed block.
+void pauseSampling()
+{
+    profiler.paused = 1;
+}
+
+void resumeSampling()
+{
+    profiler.paused = 0;
+}
+
+// Recorded stacks refer to functions that may since have become unreachable; they're kept alive until the
+// profile has been written.
+void markProfilerRoots()
+{
+    if (profiler.frames == NULL)
+        return;
+
+    for (int i = 0; i < profiler.frameCount; i++)
+        markObject((Obj *)profiler.frames[i].function);
+}
+
+#endif
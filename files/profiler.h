@@ -0,0 +1,21 @@
+#ifndef npa_profiler_h
+#define npa_profiler_h
+
+#include "common.h"
+
+#ifdef SAMPLING_PROFILER
+
+#define PROFILE_INTERVAL_US 1000 // Time between samples, in microseconds of CPU time.
+#define PROFILE_MAX_DEPTH 128    // Innermost frames kept per sample; deeper stacks lose their outer frames.
+#define PROFILE_STACKS 8192      // Distinct stacks that can be recorded (hash table size, a power of two).
+#define PROFILE_FRAMES (1 << 18) // Frames that can be stored across all distinct stacks.
+
+bool startProfiler(const char *path);
+void stopProfiler();
+void pauseSampling();
+void resumeSampling();
+void markProfilerRoots();
+
+#endif
+
+#endif
@@ -0,0 +1,712 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hash.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+#include "snapshot.h"
+#include "table.h"
+#include "verifier.h"
+#include "vm.h"
+
+// File layout, in the writing machine's byte order:
+//
+//   header   "NPAS", u32 version, u32 byte-order mark, u64 payload hash
+//   objects  u32 count, then per object: u8 type, u32 payload size, payload
+//   globals  u32 count, then per slot: u32 name (object index), value
+//
+// Objects refer to each other by index, so cycles (a closure whose upvalue holds the closure) need no special
+// handling. Natives are stored by name only and re-linked to the running VM's native of the same name. The
+// payload hash covers everything after the header.
+
+#define SNAPSHOT_MAGIC "NPAS"
+#define BYTE_ORDER_MARK 0x01020304u
+#define NO_OBJECT UINT32_MAX
+#define HEADER_SIZE 20 // Where the payload starts; the payload hash is the header's last field.
+
+typedef enum
+{
+    SNAPSHOT_NIL,
+    SNAPSHOT_FALSE,
+    SNAPSHOT_TRUE,
+    SNAPSHOT_UNDEFINED,
+    SNAPSHOT_NUMBER,
+    SNAPSHOT_OBJECT,
+} ValueTag;
+
+// The objects being written, in index order, with an open-addressing map from object to index. Plain malloc
+// is used throughout so that writing never triggers a collection.
+typedef struct
+{
+    FILE *file;
+    Obj **objects;
+    int count;
+    int capacity;
+    Obj **keys;
+    uint32_t *indexes;
+    int mapCapacity;
+    uint64_t hash; // Of everything written since the header.
+    bool failed;
+} Writer;
+
+static uint32_t hashPointer(Obj *object, int capacity)
+{
+    uintptr_t bits = (uintptr_t)object >> 3;
+    return (uint32_t)(bits * 2654435761u) & (uint32_t)(capacity - 1);
+}
+
+static void growMap(Writer *writer)
+{
+    int capacity = writer->mapCapacity < 64 ? 64 : writer->mapCapacity * 2;
+    Obj **keys = calloc(capacity, sizeof(Obj *));
+    uint32_t *indexes = malloc(sizeof(uint32_t) * capacity);
+    for (int i = 0; i < writer->count; i++)
+    {
+        uint32_t slot = hashPointer(writer->objects[i], capacity);
+        while (keys[slot] != NULL)
+            slot = (slot + 1) & (capacity - 1);
+        keys[slot] = writer->objects[i];
+        indexes[slot] = (uint32_t)i;
+    }
+
+    free(writer->keys);
+    free(writer->indexes);
+    writer->keys = keys;
+    writer->indexes = indexes;
+    writer->mapCapacity = capacity;
+}
+
+// Returns an object's index, queueing it to be written the first time it's seen.
+static uint32_t objectIndex(Writer *writer, Obj *object)
+{
+    if (writer->mapCapacity == 0 || (writer->count + 1) * 2 > writer->mapCapacity)
+        growMap(writer);
+
+    uint32_t slot = hashPointer(object, writer->mapCapacity);
+    while (writer->keys[slot] != NULL)
+    {
+        if (writer->keys[slot] == object)
+            return writer->indexes[slot];
+        slot = (slot + 1) & (writer->mapCapacity - 1);
+    }
+
+    if (writer->count == writer->capacity)
+    {
+        writer->capacity = writer->capacity < 64 ? 64 : writer->capacity * 2;
+        writer->objects = realloc(writer->objects, sizeof(Obj *) * writer->capacity);
+    }
+    writer->keys[slot] = object;
+    writer->indexes[slot] = (uint32_t)writer->count;
+    writer->objects[writer->count] = object;
+    return (uint32_t)writer->count++;
+}
+
+static void queueValue(Writer *writer, Value value)
+{
+    if (IS_OBJ(value))
+        objectIndex(writer, AS_OBJ(value));
+}
+
+// Queues everything an object refers to.
+static void queueReferences(Writer *writer, Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        objectIndex(writer, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalueCount; i++)
+            objectIndex(writer, (Obj *)closure->upvalues[i]);
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        if (function->name != NULL)
+            objectIndex(writer, (Obj *)function->name);
+        for (int i = 0; i < function->chunk.constants.count; i++)
+            queueValue(writer, function->chunk.constants.values[i]);
+        break;
+    }
+    case OBJ_NATIVE:
+        objectIndex(writer, (Obj *)((ObjNative *)object)->name);
+        break;
+    case OBJ_UPVALUE:
+    {
+        // Between scripts every upvalue is closed; an open one would point into a stack that won't exist.
+        ObjUpvalue *upvalue = (ObjUpvalue *)object;
+        if (upvalue->location != &upvalue->closed)
+            writer->failed = true;
+        queueValue(writer, upvalue->closed);
+        break;
+    }
+    case OBJ_STRING:
+    case OBJ_ROPE:
+        break;
+    }
+}
+
+static void writeBytes(Writer *writer, const void *bytes, size_t size)
+{
+    fwrite(bytes, 1, size, writer->file);
+    writer->hash = hashBytes(writer->hash, bytes, size);
+}
+
+static void writeU8(Writer *writer, uint8_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeU32(Writer *writer, uint32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+static void writeValue(Writer *writer, Value value)
+{
+    if (IS_NIL(value))
+    {
+        writeU8(writer, SNAPSHOT_NIL);
+    }
+    else if (IS_UNDEFINED(value))
+    {
+        writeU8(writer, SNAPSHOT_UNDEFINED);
+    }
+    else if (IS_BOOL(value))
+    {
+        writeU8(writer, AS_BOOL(value) ? SNAPSHOT_TRUE : SNAPSHOT_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        writeU8(writer, SNAPSHOT_NUMBER);
+        writeBytes(writer, &number, sizeof(number));
+    }
+    else
+    {
+        writeU8(writer, SNAPSHOT_OBJECT);
+        writeU32(writer, objectIndex(writer, AS_OBJ(value)));
+    }
+}
+
+static uint32_t valueSize(Value value)
+{
+    if (IS_NUMBER(value))
+        return 1 + sizeof(double);
+    return IS_OBJ(value) ? 1 + sizeof(uint32_t) : 1;
+}
+
+static uint32_t payloadSize(Obj *object)
+{
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+        return 8 + 4 * (uint32_t)((ObjClosure *)object)->upvalueCount;
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        uint32_t size = 24 + (uint32_t)function->chunk.count;
+        size += (uint32_t)function->chunk.lineCount * sizeof(LineStart);
+        for (int i = 0; i < function->chunk.constants.count; i++)
+            size += valueSize(function->chunk.constants.values[i]);
+        return size;
+    }
+    case OBJ_NATIVE:
+        return 4;
+    case OBJ_STRING:
+        return 4 + (uint32_t)((ObjString *)object)->length;
+    case OBJ_ROPE:
+        return 4 + (uint32_t)((ObjRope *)object)->length;
+    case OBJ_UPVALUE:
+        return valueSize(((ObjUpvalue *)object)->closed);
+    }
+    return 0;
+}
+
+// Writes a function's code with the quickened forms run() has written into it, hidden ones included, put back
+// to the generic instructions. The restored function starts out as the compiler left it, so it passes the same
+// checks as a loaded bytecode cache.
+static void writeCode(Writer *writer, Chunk *chunk)
+{
+    uint8_t *code = malloc((size_t)chunk->count);
+    if (code == NULL)
+    {
+        writer->failed = true;
+        return;
+    }
+    memcpy(code, chunk->code, (size_t)chunk->count);
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        int length = 1;
+        const uint8_t *sequence = fusedSequence(code[offset], &length);
+        for (int i = 0; i < length; i++)
+        {
+            if (code[offset] == OP_ADD_NUM || code[offset] == OP_ADD_STR)
+                code[offset] = OP_ADD;
+            else if (code[offset] == OP_EQUAL_NUM)
+                code[offset] = OP_EQUAL;
+            offset += opcodeLength(chunk, sequence != NULL ? sequence[i] : code[offset], offset);
+        }
+    }
+
+    writeBytes(writer, code, (size_t)chunk->count);
+    free(code);
+}
+
+// Ropes are written as the strings they stand for.
+static void writeObject(Writer *writer, Obj *object)
+{
+    writeU8(writer, (uint8_t)(object->type == OBJ_ROPE ? OBJ_STRING : object->type));
+    writeU32(writer, payloadSize(object));
+
+    switch (object->type)
+    {
+    case OBJ_CLOSURE:
+    {
+        ObjClosure *closure = (ObjClosure *)object;
+        writeU32(writer, objectIndex(writer, (Obj *)closure->function));
+        writeU32(writer, (uint32_t)closure->upvalueCount);
+        for (int i = 0; i < closure->upvalueCount; i++)
+            writeU32(writer, objectIndex(writer, (Obj *)closure->upvalues[i]));
+        break;
+    }
+    case OBJ_FUNCTION:
+    {
+        ObjFunction *function = (ObjFunction *)object;
+        Chunk *chunk = &function->chunk;
+        writeU32(writer, (uint32_t)function->arity);
+        writeU32(writer, (uint32_t)function->upvalueCount);
+        writeU32(writer, function->name == NULL ? NO_OBJECT : objectIndex(writer, (Obj *)function->name));
+        writeU32(writer, (uint32_t)chunk->count);
+        writeCode(writer, chunk);
+        writeU32(writer, (uint32_t)chunk->lineCount);
+        writeBytes(writer, chunk->lines, (size_t)chunk->lineCount * sizeof(LineStart));
+        writeU32(writer, (uint32_t)chunk->constants.count);
+        for (int i = 0; i < chunk->constants.count; i++)
+            writeValue(writer, chunk->constants.values[i]);
+        break;
+    }
+    case OBJ_NATIVE:
+        writeU32(writer, objectIndex(writer, (Obj *)((ObjNative *)object)->name));
+        break;
+    case OBJ_STRING:
+    {
+        ObjString *string = (ObjString *)object;
+        writeU32(writer, (uint32_t)string->length);
+        writeBytes(writer, string->chars, (size_t)string->length);
+        break;
+    }
+    case OBJ_ROPE:
+    {
+        ObjRope *rope = (ObjRope *)object;
+        char *chars = malloc(rope->length);
+        if (chars == NULL)
+        {
+            writer->failed = true;
+            break;
+        }
+        copyText(object, chars);
+        writeU32(writer, (uint32_t)rope->length);
+        writeBytes(writer, chars, (size_t)rope->length);
+        free(chars);
+        break;
+    }
+    case OBJ_UPVALUE:
+        writeValue(writer, ((ObjUpvalue *)object)->closed);
+        break;
+    }
+}
+
+// Writes every global and everything reachable from them. Interned strings that nothing refers to any more
+// are left out; they would only be garbage after a restore.
+bool writeSnapshot(const char *path)
+{
+    Writer writer;
+    memset(&writer, 0, sizeof(writer));
+    if (vm.frameCount != 0)
+        return false;
+
+    for (int i = 0; i < vm.globalNames.count; i++)
+    {
+        queueValue(&writer, vm.globalNames.values[i]);
+        queueValue(&writer, vm.globalValues.values[i]);
+    }
+    for (int i = 0; i < writer.count; i++)
+        queueReferences(&writer, writer.objects[i]);
+
+    if (!writer.failed)
+        writer.file = fopen(path, "wb");
+    if (writer.file != NULL)
+    {
+        // The payload hash is only known at the end, so the header is written with a placeholder and patched.
+        uint64_t placeholder = 0;
+        writeBytes(&writer, SNAPSHOT_MAGIC, 4);
+        writeU32(&writer, SNAPSHOT_VERSION);
+        writeU32(&writer, BYTE_ORDER_MARK);
+        writeBytes(&writer, &placeholder, sizeof(placeholder));
+        writer.hash = HASH_SEED;
+
+        writeU32(&writer, (uint32_t)writer.count);
+        for (int i = 0; i < writer.count; i++)
+            writeObject(&writer, writer.objects[i]);
+
+        writeU32(&writer, (uint32_t)vm.globalNames.count);
+        for (int i = 0; i < vm.globalNames.count; i++)
+        {
+            writeU32(&writer, objectIndex(&writer, AS_OBJ(vm.globalNames.values[i])));
+            writeValue(&writer, vm.globalValues.values[i]);
+        }
+        fseek(writer.file, HEADER_SIZE - sizeof(uint64_t), SEEK_SET);
+        fwrite(&writer.hash, sizeof(writer.hash), 1, writer.file);
+
+        writer.failed |= ferror(writer.file) != 0;
+        writer.failed |= fclose(writer.file) != 0;
+    }
+
+    free(writer.objects);
+    free(writer.keys);
+    free(writer.indexes);
+    return writer.file != NULL && !writer.failed;
+}
+
+// A bounds-checked cursor over the snapshot. Reads past the end return zero and mark it invalid.
+typedef struct
+{
+    const uint8_t *current;
+    const uint8_t *end;
+    bool failed;
+    ObjFunction *objects; // The restored objects as constants, which keeps them rooted while loading.
+} Reader;
+
+static const uint8_t *readBytes(Reader *reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < size)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->current;
+    reader->current += size;
+    return bytes;
+}
+
+static uint32_t readU32(Reader *reader)
+{
+    uint32_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+static uint64_t readU64(Reader *reader)
+{
+    uint64_t value = 0;
+    const uint8_t *bytes = readBytes(reader, sizeof(value));
+    if (bytes != NULL)
+        memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+// Returns the object at index if it has the expected type.
+static Obj *objectAt(Reader *reader, uint32_t index, ObjType type)
+{
+    ValueArray *objects = &reader->objects->chunk.constants;
+    if (reader->failed || index >= (uint32_t)objects->count || !isObjType(objects->values[index], type))
+    {
+        reader->failed = true;
+        return NULL;
+    }
+    return AS_OBJ(objects->values[index]);
+}
+
+static Obj *readObject(Reader *reader, ObjType type)
+{
+    return objectAt(reader, readU32(reader), type);
+}
+
+static Value readValue(Reader *reader)
+{
+    const uint8_t *tag = readBytes(reader, 1);
+    if (tag == NULL)
+        return NIL_VAL;
+
+    switch (*tag)
+    {
+    case SNAPSHOT_NIL:
+        return NIL_VAL;
+    case SNAPSHOT_FALSE:
+        return BOOL_VAL(false);
+    case SNAPSHOT_TRUE:
+        return BOOL_VAL(true);
+    case SNAPSHOT_UNDEFINED:
+        return UNDEFINED_VAL;
+    case SNAPSHOT_NUMBER:
+    {
+        double number = 0;
+        const uint8_t *bytes = readBytes(reader, sizeof(number));
+        if (bytes != NULL)
+            memcpy(&number, bytes, sizeof(number));
+        return NUMBER_VAL(number);
+    }
+    case SNAPSHOT_OBJECT:
+    {
+        uint32_t index = readU32(reader);
+        ValueArray *objects = &reader->objects->chunk.constants;
+        if (reader->failed || index >= (uint32_t)objects->count || IS_NIL(objects->values[index]))
+            break;
+        return objects->values[index];
+    }
+    }
+
+    reader->failed = true;
+    return NIL_VAL;
+}
+
+// Finds the running VM's native with this name. Natives are looked up through the global they were defined
+// under, so host natives work as long as the host defines them before restoring.
+static ObjNative *findNative(ObjString *name)
+{
+    Value slot;
+    if (!tableGet(&vm.globalSlots, name, &slot))
+        return NULL;
+
+    Value value = vm.globalValues.values[(int)AS_NUMBER(slot)];
+    if (!IS_NATIVE(value) || AS_NATIVE(value)->name != name)
+        return NULL;
+    return AS_NATIVE(value);
+}
+
+// Whether a value is a closure that reads its caller's locals. Such a closure is only ever called from the
+// function whose constant it is, so it mustn't be reachable from anywhere else.
+static bool readsCallerLocals(Value value)
+{
+    return IS_CLOSURE(value) && callerLocalsNeeded(AS_CLOSURE(value)->function) > 0;
+}
+
+// Objects are restored in three passes over the object section. The first creates strings, empty functions
+// and upvalues; the second creates closures, which need their function's upvalue count, and re-links natives;
+// the third fills in everything that refers to other objects. The restored functions are then checked the way
+// a loaded bytecode cache is, before any of them can run.
+static bool readSnapshot(Reader *reader)
+{
+    const uint8_t *magic = readBytes(reader, 4);
+    if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0)
+        return false;
+    if (readU32(reader) != SNAPSHOT_VERSION || readU32(reader) != BYTE_ORDER_MARK)
+        return false;
+    uint64_t payloadHash = readU64(reader);
+    if (reader->failed || hashBytes(HASH_SEED, reader->current, reader->end - reader->current) != payloadHash)
+        return false;
+
+    uint32_t count = readU32(reader);
+    const uint8_t *objectsStart = reader->current;
+    ValueArray *objects = &reader->objects->chunk.constants;
+
+    for (uint32_t i = 0; i < count && !reader->failed; i++)
+    {
+        const uint8_t *type = readBytes(reader, 1);
+        uint32_t size = readU32(reader);
+        const uint8_t *payload = readBytes(reader, size);
+        if (payload == NULL)
+            break;
+
+        Reader record = {payload, payload + size, false, reader->objects};
+        Obj *object = NULL;
+        switch (*type)
+        {
+        case OBJ_STRING:
+        {
+            uint32_t length = readU32(&record);
+            const uint8_t *chars = readBytes(&record, length);
+            if (chars != NULL && length <= INT32_MAX)
+                object = (Obj *)copyString((const char *)chars, (int)length);
+            break;
+        }
+        case OBJ_FUNCTION:
+        {
+            // newClosure() sizes a closure by its function's upvalue count, so that's checked before any exist.
+            uint32_t arity = readU32(&record);
+            uint32_t upvalueCount = readU32(&record);
+            if (arity > UINT8_MAX || upvalueCount > UINT8_MAX)
+            {
+                record.failed = true;
+                break;
+            }
+            ObjFunction *function = newFunction();
+            function->arity = (int)arity;
+            function->upvalueCount = (int)upvalueCount;
+            object = (Obj *)function;
+            break;
+        }
+        case OBJ_UPVALUE:
+        {
+            ObjUpvalue *upvalue = newUpvalue(NULL);
+            upvalue->location = &upvalue->closed;
+            object = (Obj *)upvalue;
+            break;
+        }
+        case OBJ_CLOSURE:
+        case OBJ_NATIVE:
+            break; // Second pass.
+        default:
+            reader->failed = true;
+            break;
+        }
+        reader->failed |= record.failed;
+
+        push(object != NULL ? OBJ_VAL(object) : NIL_VAL);
+        writeValueArray(objects, vm.stackTop[-1]);
+        pop();
+    }
+
+    for (int pass = 2; pass <= 3 && !reader->failed; pass++)
+    {
+        reader->current = objectsStart;
+        for (uint32_t i = 0; i < count && !reader->failed; i++)
+        {
+            // The first pass has already checked that every record is in bounds.
+            uint8_t type = *readBytes(reader, 1);
+            uint32_t size = readU32(reader);
+            const uint8_t *payload = readBytes(reader, size);
+            Reader record = {payload, payload + size, false, reader->objects};
+
+            if (pass == 2 && type == OBJ_CLOSURE)
+            {
+                ObjFunction *function = (ObjFunction *)readObject(&record, OBJ_FUNCTION);
+                if (function != NULL && (int)readU32(&record) == function->upvalueCount)
+                    objects->values[i] = OBJ_VAL(newClosure(function));
+                else
+                    record.failed = true;
+            }
+            else if (pass == 2 && type == OBJ_NATIVE)
+            {
+                ObjString *name = (ObjString *)readObject(&record, OBJ_STRING);
+                ObjNative *native = name != NULL ? findNative(name) : NULL;
+                if (native != NULL)
+                    objects->values[i] = OBJ_VAL(native);
+                else
+                    record.failed = true;
+            }
+            else if (pass == 3 && type == OBJ_CLOSURE)
+            {
+                ObjClosure *closure = AS_CLOSURE(objects->values[i]);
+                record.current += 8;
+                for (int upvalue = 0; upvalue < closure->upvalueCount; upvalue++)
+                    closure->upvalues[upvalue] = (ObjUpvalue *)readObject(&record, OBJ_UPVALUE);
+            }
+            else if (pass == 3 && type == OBJ_UPVALUE)
+            {
+                ((ObjUpvalue *)AS_OBJ(objects->values[i]))->closed = readValue(&record);
+            }
+            else if (pass == 3 && type == OBJ_FUNCTION)
+            {
+                ObjFunction *function = AS_FUNCTION(objects->values[i]);
+                record.current += 8;
+                uint32_t name = readU32(&record);
+                if (name != NO_OBJECT)
+                    function->name = (ObjString *)objectAt(&record, name, OBJ_STRING);
+
+                uint32_t codeCount = readU32(&record);
+                const uint8_t *code = readBytes(&record, codeCount);
+                uint32_t lineCount = readU32(&record);
+                const uint8_t *lines = readBytes(&record, (size_t)lineCount * sizeof(LineStart));
+                if (code == NULL || lines == NULL || codeCount == 0 || codeCount > INT32_MAX || lineCount == 0 ||
+                    lineCount > codeCount)
+                {
+                    record.failed = true;
+                }
+                else
+                {
+                    Chunk *chunk = &function->chunk;
+                    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, codeCount);
+                    chunk->capacity = (int)codeCount;
+                    chunk->count = (int)codeCount;
+                    memcpy(chunk->code, code, codeCount);
+                    chunk->lines = GROW_ARRAY(LineStart, NULL, 0, lineCount);
+                    chunk->lineCapacity = (int)lineCount;
+                    chunk->lineCount = (int)lineCount;
+                    memcpy(chunk->lines, lines, (size_t)lineCount * sizeof(LineStart));
+
+                    uint32_t constantCount = readU32(&record);
+                    for (uint32_t constant = 0; constant < constantCount && !record.failed; constant++)
+                        writeValueArray(&chunk->constants, readValue(&record));
+                }
+            }
+            reader->failed |= record.failed;
+        }
+    }
+
+    // Instructions address globals by slot, so every name has to come back in the slot it had.
+    uint32_t globalCount = readU32(reader);
+    if (reader->failed)
+        return false;
+
+    const uint8_t *globalsStart = reader->current;
+    for (uint32_t i = 0; i < globalCount && !reader->failed; i++)
+    {
+        ObjString *name = (ObjString *)readObject(reader, OBJ_STRING);
+        readValue(reader);
+        if (name != NULL && globalSlot(name) != (int)i)
+            reader->failed = true;
+    }
+    if (reader->failed)
+        return false;
+
+    // Every function is checked on its own before any is checked against the functions among its constants.
+    for (int i = 0; i < objects->count && !reader->failed; i++)
+        reader->failed = IS_FUNCTION(objects->values[i]) && !verifyCode(AS_FUNCTION(objects->values[i]));
+    for (int i = 0; i < objects->count && !reader->failed; i++)
+        reader->failed = IS_FUNCTION(objects->values[i]) && !verifyFunction(AS_FUNCTION(objects->values[i]));
+    for (int i = 0; i < objects->count && !reader->failed; i++)
+    {
+        Value value = objects->values[i];
+        reader->failed = isObjType(value, OBJ_UPVALUE) && readsCallerLocals(((ObjUpvalue *)AS_OBJ(value))->closed);
+    }
+
+    reader->current = globalsStart;
+    for (uint32_t i = 0; i < globalCount && !reader->failed; i++)
+    {
+        readU32(reader);
+        reader->failed = readsCallerLocals(readValue(reader));
+    }
+    if (reader->failed)
+        return false;
+
+    reader->current = globalsStart;
+    for (uint32_t i = 0; i < globalCount; i++)
+    {
+        readU32(reader);
+        vm.globalValues.values[i] = readValue(reader);
+    }
+    return true;
+}
+
+// Restores a snapshot written by writeSnapshot() into a fresh VM. On failure the globals are left untouched.
+bool loadSnapshot(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    uint8_t *buffer = malloc(size > 0 ? size : 1);
+    size_t bytesRead = buffer != NULL ? fread(buffer, 1, size, file) : 0;
+    fclose(file);
+    if (buffer == NULL)
+        return false;
+
+    Reader reader = {buffer, buffer + bytesRead, false, newFunction()};
+    push(OBJ_VAL(reader.objects));
+    bool restored = readSnapshot(&reader);
+    pop();
+    free(buffer);
+    return restored;
+}
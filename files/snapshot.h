@@ -0,0 +1,15 @@
+#ifndef npa_snapshot_h
+#define npa_snapshot_h
+
+#include "common.h"
+
+// Heap snapshots. After a prelude script has run, everything reachable from the globals (closures, functions,
+// strings, closed upvalues and the natives they refer to) can be written to a file and later restored into a
+// fresh VM in place of running the prelude again.
+
+#define SNAPSHOT_VERSION 5 // Bump whenever the opcode set or the file layout changes.
+
+bool writeSnapshot(const char *path);
+bool loadSnapshot(const char *path);
+
+#endif
@@ -1,58 +1,132 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "debug.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 
-#define TABLE_MAX_LOAD 0.75
+#ifdef SIMD_TABLE
+#include <emmintrin.h>
+#endif
+
+// The table grows once 7 in 8 slots are used or deleted.
+#define TABLE_MAX_LOAD(capacity) ((capacity) / 8 * 7)
+
+// Control bytes. A slot in use holds the low 7 bits of its key's hash, so its top bit is clear.
+#define CONTROL_EMPTY 0x80
+#define CONTROL_DELETED 0xFE
+
+// The bits of a hash that pick the first group to probe, and the ones kept in the control byte.
+#define HASH_GROUP(hash) ((hash) >> 7)
+#define HASH_TAG(hash) ((uint8_t)((hash)&0x7F))
 
 void initTable(Table *table)
 {
     table->count = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 // Frees the memory associated with a hash table.
 void freeTable(Table *table)
 {
+    FREE_ARRAY(uint8_t, table->control, table->capacity);
     FREE_ARRAY(Entry, table->entries, table->capacity);
     initTable(table);
 }
 
-// Finds an entry in the hash table, possibly returning a tombstone if it's part of a previous deletion.
-static Entry *findEntry(Entry *entries, int capacity, ObjString *key)
+// Returns a bit per slot of the group at control whose byte equals the given one.
+static inline uint32_t matchByte(const uint8_t *control, uint8_t byte)
 {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
+#ifdef SIMD_TABLE
+    __m128i group = _mm_loadu_si128((const __m128i *)control);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)byte)));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
+    {
+        if (control[i] == byte)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-    for (;;)
+// Returns a bit per slot of the group that is empty or deleted, the bytes with the top bit set.
+static inline uint32_t matchFree(const uint8_t *control)
+{
+#ifdef SIMD_TABLE
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)control));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < TABLE_GROUP; i++)
     {
-        Entry *entry = &entries[index];
+        if (control[i] & 0x80)
+            mask |= 1u << i;
+    }
+    return mask;
+#endif
+}
 
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-            {
-                // Empty Entry
-                return tombstone != NULL ? tombstone : entry;
-            }
-            else
-            {
-                if (tombstone == NULL)
-                    tombstone = entry;
-            }
-        }
-        else if (entry->key == key)
+// Groups are probed in triangular steps (1, 2, 3, ... groups on), which visits every group once when their
+// number is a power of two. A probe stops at the first group with an empty slot: a key is never placed past
+// a group that had room for it.
+#define FOR_EACH_GROUP(table, hash, group)                                                 \
+    for (uint32_t groupMask = (uint32_t)(table)->capacity / TABLE_GROUP - 1, step = 0,     \
+                  group = HASH_GROUP(hash) & groupMask;                                    \
+         ; step++, group = (group + step) & groupMask)
+
+// Index of the lowest set bit of a nonzero mask.
+static inline int lowestBit(uint32_t mask)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(mask);
+#else
+    int bit = 0;
+    while (!(mask & 1))
+    {
+        mask >>= 1;
+        bit++;
+    }
+    return bit;
+#endif
+}
+
+// Finds the slot holding key, or returns -1.
+static int findSlot(Table *table, ObjString *key)
+{
+#ifdef DEBUG_COUNT_OPCODES
+    opcodeCounters.tableLookups++;
+#endif
+    uint8_t tag = HASH_TAG(key->hash);
+    FOR_EACH_GROUP(table, key->hash, group)
+    {
+#ifdef DEBUG_COUNT_OPCODES
+        opcodeCounters.tableProbes++;
+#endif
+        const uint8_t *control = &table->control[group * TABLE_GROUP];
+        for (uint32_t matches = matchByte(control, tag); matches != 0; matches &= matches - 1)
         {
-            // Found key
-            return entry;
+            int slot = (int)(group * TABLE_GROUP) + lowestBit(matches);
+            if (table->entries[slot].key == key)
+                return slot;
         }
+        if (matchByte(control, CONTROL_EMPTY) != 0)
+            return -1;
+    }
+}
 
-        // Linear probing in case of collision.
-        index = (index + 1) % capacity;
+// Returns the first empty or deleted slot on the key's probe sequence.
+static int findFreeSlot(Table *table, uint32_t hash)
+{
+    FOR_EACH_GROUP(table, hash, group)
+    {
+        uint32_t free = matchFree(&table->control[group * TABLE_GROUP]);
+        if (free != 0)
+            return (int)(group * TABLE_GROUP) + lowestBit(free);
     }
 }
 
@@ -62,60 +136,79 @@ bool tableGet(Table *table, ObjString *key, Value *value)
     if (table->count == 0)
         return false;
 
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot < 0)
         return false;
 
-    *value = entry->value;
-
+    *value = table->entries[slot].value;
     return true;
 }
 
-// Adjusts the capacity of the hash table, rehashing all entries.
+// Rebuilds the table with the given capacity, rehashing all entries and dropping deleted slots. Both arrays
+// are allocated before the table is touched: a collection in ALLOCATE sweeps the string table.
 static void adjustCapacity(Table *table, int capacity)
 {
-    Entry *entries = ALLOCATE(Entry, capacity);
-    for (int i = 0; i < capacity; i++)
-    {
-        entries[i].key = NULL;
-        entries[i].value = NIL_VAL;
-    }
+    Table resized;
+    resized.control = ALLOCATE(uint8_t, capacity);
+    resized.entries = ALLOCATE(Entry, capacity);
+    resized.capacity = capacity;
+    resized.count = 0;
+    memset(resized.control, CONTROL_EMPTY, capacity);
 
-    table->count = 0;
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL)
+        if (table->control[i] & 0x80)
             continue;
 
-        Entry *dest = findEntry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
-        table->count++;
+        Entry *entry = &table->entries[i];
+        int slot = findFreeSlot(&resized, entry->key->hash);
+        resized.control[slot] = HASH_TAG(entry->key->hash);
+        resized.entries[slot] = *entry;
+        resized.count++;
     }
 
-    FREE_ARRAY(Entry, table->entries, table->capacity);
-    table->entries = entries;
-    table->capacity = capacity;
+    freeTable(table);
+    *table = resized;
+}
+
+// Makes room for one more slot to be used. Deleted slots are reclaimed by rebuilding at the same size when
+// they, rather than live entries, are what filled the table.
+static void ensureCapacity(Table *table)
+{
+    if (table->count + 1 <= TABLE_MAX_LOAD(table->capacity))
+        return;
+
+    int live = 0;
+    for (int i = 0; i < table->capacity; i++)
+    {
+        if (!(table->control[i] & 0x80))
+            live++;
+    }
+
+    int capacity = table->capacity < TABLE_GROUP ? TABLE_GROUP : table->capacity;
+    if (live + 1 > TABLE_MAX_LOAD(capacity) / 2)
+        capacity *= 2;
+    adjustCapacity(table, capacity);
 }
 
 // Inserts or updates a value in the hash table.
 bool tableSet(Table *table, ObjString *key, Value value)
 {
-    // Expand the hash table if the load factor is too high.
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD)
+    int slot = table->count > 0 ? findSlot(table, key) : -1;
+    if (slot >= 0)
     {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        table->entries[slot].value = value;
+        return false;
     }
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
-    if (isNewKey && IS_NIL(entry->value))
-        table->count++;
 
-    entry->key = key;
-    entry->value = value;
-    return isNewKey;
+    ensureCapacity(table);
+    slot = findFreeSlot(table, key->hash);
+    if (table->control[slot] == CONTROL_EMPTY)
+        table->count++;
+    table->control[slot] = HASH_TAG(key->hash);
+    table->entries[slot].key = key;
+    table->entries[slot].value = value;
+    return true;
 }
 
 // Deletes an entry from the hash table.
@@ -124,15 +217,39 @@ bool tableDelete(Table *table, ObjString *key)
     if (table->count == 0)
         return false;
 
-    // Find entry
-    Entry *entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL)
+    int slot = findSlot(table, key);
+    if (slot < 0)
         return false;
 
-    // tombstone on entry
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    // A probe only goes past a group that has no empty slot. If this group already has one, no probe can be
+    // relying on it being full, so the slot can go straight back to empty instead of becoming a tombstone.
+    const uint8_t *group = &table->control[slot / TABLE_GROUP * TABLE_GROUP];
+    if (matchByte(group, CONTROL_EMPTY) != 0)
+    {
+        table->control[slot] = CONTROL_EMPTY;
+        table->count--;
+    }
+    else
+    {
+        table->control[slot] = CONTROL_DELETED;
+    }
+    table->entries[slot].key = NULL;
+    table->entries[slot].value = NIL_VAL;
+    return true;
+}
 
+// Swaps key for moved, a copy of the same string the collector has made. The copy has the same hash, so the
+// entry stays in its slot.
+bool tableReplaceKey(Table *table, ObjString *key, ObjString *moved)
+{
+    if (table->count == 0)
+        return false;
+
+    int slot = findSlot(table, key);
+    if (slot < 0)
+        return false;
+
+    table->entries[slot].key = moved;
     return true;
 }
 
@@ -141,37 +258,35 @@ void tableAddAll(Table *from, Table *to)
 {
     for (int i = 0; i < from->capacity; i++)
     {
-        Entry *entry = &from->entries[i];
-        if (entry->key != NULL)
-        {
-            tableSet(to, entry->key, entry->value);
-        }
+        if (!(from->control[i] & 0x80))
+            tableSet(to, from->entries[i].key, from->entries[i].value);
     }
 }
 
-// Finds a string in the hash table.
+// Finds a string in the hash table by its characters.
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash)
 {
     if (table->count == 0)
         return NULL;
 
-    uint32_t index = hash % table->capacity;
-
-    for (;;)
+#ifdef DEBUG_COUNT_OPCODES
+    opcodeCounters.tableLookups++;
+#endif
+    uint8_t tag = HASH_TAG(hash);
+    FOR_EACH_GROUP(table, hash, group)
     {
-        Entry *entry = &table->entries[index];
-        if (entry->key == NULL)
-        {
-            if (IS_NIL(entry->value))
-                return NULL;
-        }
-        else if (entry->key->length == length && entry->key->hash && memcmp(entry->key->chars, chars, length) == 0)
+#ifdef DEBUG_COUNT_OPCODES
+        opcodeCounters.tableProbes++;
+#endif
+        const uint8_t *control = &table->control[group * TABLE_GROUP];
+        for (uint32_t matches = matchByte(control, tag); matches != 0; matches &= matches - 1)
         {
-            // FOUND IT BITCH
-            return entry->key;
+            ObjString *key = table->entries[group * TABLE_GROUP + lowestBit(matches)].key;
+            if (key->hash == hash && key->length == length && memcmp(key->chars, chars, length) == 0)
+                return key;
         }
-
-        index = (index + 1) % table->capacity;
+        if (matchByte(control, CONTROL_EMPTY) != 0)
+            return NULL;
     }
 }
 
@@ -180,11 +295,10 @@ void tableRemoveWhite(Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry *entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked)
-        {
-            tableDelete(table, entry->key);
-        }
+        // Young strings are never marked; young collections drop the ones that die.
+        if (!(table->control[i] & 0x80) && !table->entries[i].key->obj.isMarked &&
+            !isYoung((Obj *)table->entries[i].key))
+            tableDelete(table, table->entries[i].key);
     }
 }
 
@@ -193,8 +307,9 @@ void markTable(Table *table)
 {
     for (int i = 0; i < table->capacity; i++)
     {
-        Entry *entry = &table->entries[i];
-        markObject((Obj *)entry->key);
-        markValue(entry->value);
+        if (table->control[i] & 0x80)
+            continue;
+        markObject((Obj *)table->entries[i].key);
+        markValue(table->entries[i].value);
     }
-}
\ No newline at end of file
+}
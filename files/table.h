@@ -10,10 +10,16 @@ typedef struct
     Value value;
 } Entry;
 
+// An open-addressing table in the style of a Swiss table. Besides its entry, every slot has one control byte:
+// empty, deleted, or the low 7 bits of the key's hash when in use. Lookups scan the control bytes a group of
+// TABLE_GROUP slots at a time and only look at entries whose byte matches.
+#define TABLE_GROUP 16
+
 typedef struct
 {
-    int count;
-    int capacity;
+    int count;        // Slots in use or deleted; deleted ones still lengthen probes until the next resize.
+    int capacity;     // Zero, or a power of two no smaller than TABLE_GROUP.
+    uint8_t *control; // One control byte per slot.
     Entry *entries;
 } Table;
 
@@ -22,6 +28,7 @@ void freeTable(Table *table);
 bool tableSet(Table *table, ObjString *key, Value value);
 bool tableGet(Table *table, ObjString *key, Value *value);
 bool tableDelete(Table *table, ObjString *key);
+bool tableReplaceKey(Table *table, ObjString *key, ObjString *moved);
 void tableAddAll(Table *from, Table *to);
 ObjString *tableFindString(Table *table, const char *chars, int length, uint32_t hash);
 
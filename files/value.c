@@ -39,6 +39,24 @@ void freeValueArray(ValueArray *array)
 // Prints a value for debugging or output purposes.
 void printValue(Value value)
 {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value))
+    {
+        printf(AS_BOOL(value) ? "true" : "false"); // Print boolean values.
+    }
+    else if (IS_NIL(value))
+    {
+        printf("nil"); // Print nil (null) values.
+    }
+    else if (IS_NUMBER(value))
+    {
+        printf("%g", AS_NUMBER(value)); // Print numbers.
+    }
+    else if (IS_OBJ(value))
+    {
+        printObject(value); // Delegates to a different function for object values.
+    }
+#else
     switch (value.type)
     {
     case VAL_BOOL:
@@ -53,12 +71,22 @@ void printValue(Value value)
     case VAL_OBJ:
         printObject(value); // Delegates to a different function for object values.
         break;
+    case VAL_UNDEFINED:
+        printf("undefined"); // Only reachable from debug output.
+        break;
     }
+#endif
 }
 
 // Compares two Value instances for equality.
 bool valuesEqual(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    // Numbers still compare as doubles so that NaN != NaN; everything else is equal only if the bits are.
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    return a == b;
+#else
     if (a.type != b.type)
         return false; // Different types means they are not equal.
 
@@ -72,7 +100,10 @@ bool valuesEqual(Value a, Value b)
         return AS_NUMBER(a) == AS_NUMBER(b); // Compare numbers.
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b); // Compare object pointers.
+    case VAL_UNDEFINED:
+        return true;
     default:
         return false; // Unreachable, all value types should be handled above.
     }
+#endif
 }
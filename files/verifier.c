@@ -0,0 +1,225 @@
+#include <stdlib.h>
+
+#include "optimizer.h"
+#include "verifier.h"
+#include "vm.h"
+
+// Returns how many of its caller's locals a function reaches with OP_GET_CALLER_LOCAL and OP_SET_CALLER_LOCAL,
+// or 0 if it uses neither. The function has passed verifyCode() already.
+int callerLocalsNeeded(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int needed = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if ((instruction == OP_GET_CALLER_LOCAL || instruction == OP_SET_CALLER_LOCAL) &&
+            chunk->code[offset + 1] >= needed)
+            needed = chunk->code[offset + 1] + 1;
+    }
+    return needed;
+}
+
+// Checks the operands of one instruction, with opcode standing in for whatever byte is at offset (the first
+// byte of a superinstruction holds the fused opcode). Returns the instruction's length, or 0 if it doesn't fit
+// the chunk or refers to a constant, global, upvalue or enclosing upvalue that isn't there.
+static int verifyOperands(ObjFunction *function, uint8_t opcode, int offset)
+{
+    Chunk *chunk = &function->chunk;
+    const uint8_t *operands = &chunk->code[offset + 1];
+    int available = chunk->count - offset;
+
+    // opcodeLength() reads the function constant of an OP_CLOSURE, so that has to be checked first.
+    if (opcode == OP_CLOSURE &&
+        (available < 2 || operands[0] >= chunk->constants.count || !IS_FUNCTION(chunk->constants.values[operands[0]])))
+        return 0;
+
+    int length = opcodeLength(chunk, opcode, offset);
+    if (length > available)
+        return 0;
+
+    switch (opcode)
+    {
+    case OP_CONSTANT:
+        return operands[0] < chunk->constants.count ? length : 0;
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_CALL_NATIVE:
+        return ((operands[0] << 8) | operands[1]) < vm.globalValues.count ? length : 0;
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+        return operands[0] < function->upvalueCount ? length : 0;
+    case OP_CLOSURE:
+        for (int i = 2; i < length; i += 2)
+        {
+            uint8_t isLocal = chunk->code[offset + i];
+            uint8_t index = chunk->code[offset + i + 1];
+            if (isLocal > 1 || (!isLocal && index >= function->upvalueCount))
+                return 0;
+        }
+        return length;
+    default:
+        return opcode < OP_ADD_LOCALS ? length : 0;
+    }
+}
+
+// Applies an instruction's effect to the stack height, counted from the frame's slot 0. Returns false if the
+// instruction would pop slot 0 or more, reach a local past the top, or grow the frame past FRAME_STACK_SLOTS.
+static bool applyStackEffect(Chunk *chunk, uint8_t opcode, int offset, int *height)
+{
+    const uint8_t *operands = &chunk->code[offset + 1];
+    if ((opcode == OP_GET_LOCAL || opcode == OP_SET_LOCAL) && operands[0] >= *height)
+        return false;
+    if (opcode == OP_CLOSURE)
+    {
+        for (int i = 2; i < opcodeLength(chunk, opcode, offset); i += 2)
+        {
+            if (chunk->code[offset + i] && chunk->code[offset + i + 1] > *height) // The closure may capture itself.
+                return false;
+        }
+    }
+
+    int popped;
+    int pushed;
+    stackEffect(chunk, opcode, offset, &popped, &pushed);
+    if (popped >= *height)
+        return false;
+    *height += pushed - popped;
+    return *height <= FRAME_STACK_SLOTS;
+}
+
+// Walks a function's code, filling in the original opcode of every instruction and the stack height on entry
+// to it (-1 if it can't be reached, -2 for operand bytes). Returns false if the code is invalid.
+static bool checkCode(ObjFunction *function, uint8_t *opcodes, int *heights)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    if ((uint32_t)function->arity > UINT8_MAX || (uint32_t)function->upvalueCount > UINT8_MAX)
+        return false;
+
+    for (int i = 0; i < count; i++)
+        heights[i] = -2;
+    bool valid = true;
+
+    for (int offset = 0; valid && offset < count;)
+    {
+        uint8_t instruction = chunk->code[offset];
+        int length = 1;
+        const uint8_t *sequence = fusedSequence(instruction, &length);
+        for (int i = 0; valid && i < length; i++)
+        {
+            uint8_t opcode = sequence != NULL ? sequence[i] : instruction;
+            int size = offset < count && (i == 0 || chunk->code[offset] == opcode)
+                           ? verifyOperands(function, opcode, offset)
+                           : 0;
+            valid = size > 0;
+            if (valid)
+            {
+                opcodes[offset] = opcode;
+                heights[offset] = -1;
+            }
+            offset += size;
+        }
+    }
+
+    int *worklist = malloc((size_t)count * sizeof(int));
+    int pending = 0;
+    if (valid)
+    {
+        heights[0] = function->arity + 1; // The callee and its arguments.
+        worklist[pending++] = 0;
+    }
+    while (valid && pending > 0)
+    {
+        int offset = worklist[--pending];
+        uint8_t opcode = opcodes[offset];
+        int height = heights[offset];
+        valid = applyStackEffect(chunk, opcode, offset, &height);
+
+        int successors[2];
+        int successorCount = 0;
+        if (opcode != OP_JUMP && opcode != OP_LOOP && opcode != OP_RETURN)
+            successors[successorCount++] = offset + opcodeLength(chunk, opcode, offset);
+        if (opcode == OP_JUMP || opcode == OP_JUMP_IF_FALSE || opcode == OP_LOOP)
+        {
+            int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+            successors[successorCount++] = offset + 3 + (opcode == OP_LOOP ? -jump : jump);
+        }
+
+        for (int i = 0; valid && i < successorCount; i++)
+        {
+            int successor = successors[i];
+            if (successor < 0 || successor >= count || heights[successor] == -2)
+            {
+                valid = false;
+            }
+            else if (heights[successor] == -1)
+            {
+                heights[successor] = height;
+                worklist[pending++] = successor;
+            }
+            else
+            {
+                valid = heights[successor] == height;
+            }
+        }
+    }
+
+    free(worklist);
+    return valid;
+}
+
+// Checks that a function's code can't take run() outside the function's code, constants, upvalues or stack
+// frame, or outside the global slots. A superinstruction is checked as the original instructions it hides,
+// since run() may fall back to executing those; the quickened forms run() creates itself are never written
+// out, so they are rejected. Every path from the entry has to give each instruction the same stack height,
+// keep jumps on instruction boundaries and end in OP_RETURN rather than running off the end of the code.
+bool verifyCode(ObjFunction *function)
+{
+    int count = function->chunk.count;
+    if (count <= 0)
+        return false;
+
+    uint8_t *opcodes = malloc((size_t)count);
+    int *heights = malloc((size_t)count * sizeof(int));
+    bool valid = checkCode(function, opcodes, heights);
+    free(opcodes);
+    free(heights);
+    return valid;
+}
+
+// Does what verifyCode() does, and also checks the closures that read their caller's locals: they have to be
+// ones the optimizer could have made, loaded where those locals already exist and only ever called from this
+// function (see closureStaysLocal()), and never made afresh by OP_CLOSURE. The functions among the constants
+// must have passed verifyCode() already.
+bool verifyFunction(ObjFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    int count = chunk->count;
+    if (count <= 0)
+        return false;
+
+    uint8_t *opcodes = malloc((size_t)count);
+    int *heights = malloc((size_t)count * sizeof(int));
+    bool valid = checkCode(function, opcodes, heights);
+
+    for (int offset = 0; valid && offset < count; offset++)
+    {
+        if (heights[offset] < 0 || (opcodes[offset] != OP_CONSTANT && opcodes[offset] != OP_CLOSURE))
+            continue;
+        Value constant = chunk->constants.values[chunk->code[offset + 1]];
+        if (opcodes[offset] == OP_CLOSURE)
+        {
+            valid = callerLocalsNeeded(AS_FUNCTION(constant)) == 0;
+            continue;
+        }
+        int needed = IS_CLOSURE(constant) ? callerLocalsNeeded(AS_CLOSURE(constant)->function) : 0;
+        if (needed > 0)
+            valid = needed <= heights[offset] && closureStaysLocal(chunk, opcodes, heights, offset);
+    }
+
+    free(opcodes);
+    free(heights);
+    return valid;
+}
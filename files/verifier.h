@@ -0,0 +1,15 @@
+#ifndef npa_verifier_h
+#define npa_verifier_h
+
+#include "common.h"
+#include "object.h"
+
+// Checks for bytecode the compiler didn't just produce: functions loaded from a bytecode cache or restored
+// from a heap snapshot. Both run the functions they accept as they are, so everything run() takes on trust
+// has to be checked here first.
+
+bool verifyCode(ObjFunction *function);
+bool verifyFunction(ObjFunction *function);
+int callerLocalsNeeded(ObjFunction *function);
+
+#endif
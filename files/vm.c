@@ -1,4 +1,5 @@
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
@@ -7,31 +8,37 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "object.h"
 #include "memory.h"
+#include "profiler.h"
 #include "vm.h"
 
 VM vm; // Global VM instance.
 
+#define TRACE_FRAMES 32 // Frames printed from each end of a runtime error's stack trace.
+
 // Native function to get the current time.
-static Value clockNative(int argCount, Value *args)
+static bool clockNative(int argCount, Value *args, Value *result)
 {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    *result = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
 }
 
 // Native function to read input from the user.
-static Value inputNative(int argCount, Value *args)
+static bool inputNative(int argCount, Value *args, Value *result)
 {
     char inputBuffer[1024];
 
-    if (argCount > 0 && IS_STRING(args[0]))
+    if (argCount > 0 && IS_TEXT(args[0]))
     {
-        printf("%s", AS_CSTRING(args[0]));
+        printValue(args[0]);
     }
 
     if (fgets(inputBuffer, sizeof(inputBuffer), stdin) == NULL)
     {
-        return NIL_VAL;
+        *result = NIL_VAL;
+        return true;
     }
 
     // Remove newline character.
@@ -42,18 +49,21 @@ static Value inputNative(int argCount, Value *args)
     long intVal = strtol(inputBuffer, &end, 10);
     if (*end == '\0')
     {
-        return NUMBER_VAL((double)intVal);
+        *result = NUMBER_VAL((double)intVal);
+        return true;
     }
 
     // Try to convert to floating point.
     double floatVal = strtod(inputBuffer, &end);
     if (*end == '\0')
     {
-        return NUMBER_VAL(floatVal);
+        *result = NUMBER_VAL(floatVal);
+        return true;
     }
 
     // Return as string if not a number.
-    return OBJ_VAL(copyString(inputBuffer, strlen(inputBuffer)));
+    *result = OBJ_VAL(copyString(inputBuffer, strlen(inputBuffer)));
+    return true;
 }
 
 // Resets the VM stack to its initial state.
@@ -64,23 +74,63 @@ static void resetStack()
     vm.openUpvalues = NULL;
 }
 
+// Moves the stack to a block with room for `needed` more values above stackTop. The stack is copied over,
+// then everything that points into the old block (stackTop, frame slots, open upvalues) is rebased onto it.
+static void growStack(int needed)
+{
+    int used = (int)(vm.stackTop - vm.stack);
+    int capacity = vm.stackCapacity;
+    while (capacity < used + needed)
+        capacity = GROW_CAPACITY(capacity);
+
+    // The old block stays valid until the copy is done, including through a collection in ALLOCATE.
+    Value *stack = ALLOCATE(Value, capacity);
+    if (used > 0)
+        memcpy(stack, vm.stack, sizeof(Value) * used);
+
+    for (int i = 0; i < vm.frameCount; i++)
+    {
+        vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+    }
+    for (ObjUpvalue *upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+    {
+        upvalue->location = stack + (upvalue->location - vm.stack);
+    }
+
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    vm.stack = stack;
+    vm.stackTop = stack + used;
+    vm.stackCapacity = capacity;
+}
+
+// Makes room for `needed` more values above stackTop.
+static inline void ensureStack(int needed)
+{
+    if (vm.stackTop + needed > vm.stack + vm.stackCapacity)
+        growStack(needed);
+}
+
 // Prints a runtime error and its location.
-static void runtimeError(const char *format, ...)
+static void reportRuntimeError(const char *format, va_list args)
 {
     // Print formatted error message.
-    va_list args;
-    va_start(args, format);
     vfprintf(stderr, format, args);
-    va_end(args);
     fputs("\n", stderr);
 
-    // Print stack trace.
+    // Print stack trace. Deep recursion can leave a very long chain of frames, so only both ends are shown.
     for (int i = vm.frameCount - 1; i >= 0; i--)
     {
+        if (vm.frameCount > 2 * TRACE_FRAMES && i == vm.frameCount - 1 - TRACE_FRAMES)
+        {
+            fprintf(stderr, "[... %d frames omitted]\n", vm.frameCount - 2 * TRACE_FRAMES);
+            i = TRACE_FRAMES;
+            continue;
+        }
+
         CallFrame *frame = &vm.frames[i];
         ObjFunction *function = frame->closure->function;
         size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
         if (function->name == NULL)
         {
             fprintf(stderr, "script\n");
@@ -94,12 +144,56 @@ static void runtimeError(const char *format, ...)
     resetStack();
 }
 
-// Defines a native function in the VM.
-static void defineNative(const char *name, NativeFn function)
+static void runtimeError(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    reportRuntimeError(format, args);
+    va_end(args);
+}
+
+// Reports a runtime error from inside a native function, which then returns false: `return nativeError(...);`.
+bool nativeError(const char *format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    reportRuntimeError(format, args);
+    va_end(args);
+    return false;
+}
+
+// Returns the slot for a global variable, reserving an undefined slot the first time the name is seen.
+int globalSlot(ObjString *name)
+{
+    Value index;
+    if (tableGet(&vm.globalSlots, name, &index))
+        return (int)AS_NUMBER(index);
+
+    // The name may not be reachable from anywhere else yet, so keep it on the stack while the arrays grow.
+    push(OBJ_VAL(name));
+    int slot = vm.globalValues.count;
+    writeValueArray(&vm.globalValues, UNDEFINED_VAL);
+    writeValueArray(&vm.globalNames, OBJ_VAL(name));
+    if (vm.globalCardCapacity < vm.globalValues.capacity)
+    {
+        int oldCapacity = vm.globalCardCapacity;
+        vm.globalCardCapacity = vm.globalValues.capacity;
+        vm.globalCards = GROW_ARRAY(uint8_t, vm.globalCards, oldCapacity, vm.globalCardCapacity);
+        memset(vm.globalCards + oldCapacity, 0, vm.globalCardCapacity - oldCapacity);
+    }
+    tableSet(&vm.globalSlots, name, NUMBER_VAL((double)slot));
+    pop();
+    return slot;
+}
+
+// Defines a native function as a global. Hosts call this after initVM() to add their own functions; an arity of
+// -1 accepts any number of arguments.
+void defineNative(const char *name, NativeFn function, int arity, uint8_t flags)
 {
     push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
+    push(OBJ_VAL(newNative(function, AS_STRING(vm.stack[0]), arity, flags)));
+    int slot = globalSlot(AS_STRING(vm.stack[0]));
+    vm.globalValues.values[slot] = vm.stack[1];
     pop();
     pop();
 }
@@ -107,31 +201,71 @@ static void defineNative(const char *name, NativeFn function)
 // Initializes the VM.
 void initVM()
 {
+    vm.stack = NULL;
+    vm.stackCapacity = 0;
+    vm.frames = NULL;
+    vm.frameCapacity = 0;
     resetStack();
     vm.objects = NULL;
+#ifdef BASELINE_JIT
+    vm.jitEnabled = false;
+#endif
 
     // Initialize memory management fields.
     vm.bytesAllocated = 0;
     vm.nextGC = 1024 * 1024;
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm.gray.count = 0;
+    vm.gray.capacity = 0;
+    vm.gray.objects = NULL;
+    vm.nursery = malloc(NURSERY_SIZE);
+    if (vm.nursery == NULL)
+        exit(1);
+    vm.nurseryTop = vm.nursery;
+    vm.nurseryOpen = false;
+    vm.gcPauseBudget = 0;
+    vm.gcPhase = GC_IDLE;
+    vm.sweeping = NULL;
+    vm.nextSlice = 0;
+    vm.gcConcurrent = false;
+    setNurseryLimit();
+    vm.remembered = NULL;
+    vm.rememberedCount = 0;
+    vm.rememberedCapacity = 0;
 
     // Initialize global variables and string intern table.
-    initTable(&vm.globals);
+    initTable(&vm.globalSlots);
+    initValueArray(&vm.globalValues);
+    initValueArray(&vm.globalNames);
+    vm.globalCards = NULL;
+    vm.globalCardCapacity = 0;
     initTable(&vm.strings);
 
+    // Room for the script's frame; deeper calls grow the stack from there.
+    ensureStack(FRAME_STACK_SLOTS);
+
     // Define native functions.
-    defineNative("clock", clockNative);
-    defineNative("input", inputNative);
+    defineNative("clock", clockNative, 0, 0);
+    defineNative("input", inputNative, -1, NATIVE_ALLOCATES);
 }
 
 // Frees resources used by the VM.
 void freeVM()
 {
-    freeTable(&vm.globals);
+#ifdef SAMPLING_PROFILER
+    stopProfiler(); // Resolves the sampled functions while they still exist.
+#endif
+    freeTable(&vm.globalSlots);
+    freeValueArray(&vm.globalValues);
+    freeValueArray(&vm.globalNames);
+    FREE_ARRAY(uint8_t, vm.globalCards, vm.globalCardCapacity);
     freeTable(&vm.strings);
+    FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
+    FREE_ARRAY(CallFrame, vm.frames, vm.frameCapacity);
     freeObjects();
+    printGcStats();
+#ifdef DEBUG_COUNT_OPCODES
+    writeOpcodeCounts();
+#endif
 }
 
 // Pushes a value onto the VM stack.
@@ -159,13 +293,33 @@ static Value peek(int distance)
 // The `run` function is particularly important, as it reads and executes bytecode instructions in a loop, effectively running the VM.
 // `interpret` is the entry point for executing a script, compiling the source code and initiating its execution.
 
-static bool call(ObjClosure *closure, int argCount)
+#ifdef BASELINE_JIT
+// Counts a call or loop back-edge and compiles the function once it gets hot.
+static void countHotness(ObjFunction *function)
+{
+    if (function->jit != NULL || ++function->hotness < JIT_HOT_THRESHOLD)
+        return;
+
+    // Without executable memory there is nothing to gain from trying again.
+    if (!jitCompile(function))
+        vm.jitEnabled = false;
+}
+#endif
+
+static bool checkArity(int arity, int argCount)
 {
-    if (argCount != closure->function->arity)
+    if (argCount != arity)
     {
-        runtimeError("Expected %d arguments but got %d. | 2 Chronicles 15:7 But as for you, be strong and do not give up, for your work will be rewarded.”", closure->function->arity, argCount);
+        runtimeError("Expected %d arguments but got %d. | 2 Chronicles 15:7 But as for you, be strong and do not give up, for your work will be rewarded.”", arity, argCount);
         return false;
     }
+    return true;
+}
+
+static bool call(ObjClosure *closure, int argCount)
+{
+    if (!checkArity(closure->function->arity, argCount))
+        return false;
 
     if (vm.frameCount == FRAMES_MAX)
     {
@@ -173,10 +327,49 @@ static bool call(ObjClosure *closure, int argCount)
         return false;
     }
 
-    CallFrame *frame = &vm.frames[vm.frameCount++];
+    // Growing either array moves it; run() reloads its frame pointer after every call.
+    if (vm.frameCount == vm.frameCapacity)
+    {
+        int oldCapacity = vm.frameCapacity;
+        vm.frameCapacity = GROW_CAPACITY(oldCapacity);
+#ifdef SAMPLING_PROFILER
+        pauseSampling();
+#endif
+        vm.frames = GROW_ARRAY(CallFrame, vm.frames, oldCapacity, vm.frameCapacity);
+#ifdef SAMPLING_PROFILER
+        resumeSampling();
+#endif
+    }
+    ensureStack(FRAME_STACK_SLOTS);
+
+#ifdef BASELINE_JIT
+    if (vm.jitEnabled)
+        countHotness(closure->function);
+#endif
+
+    // The frame is filled in before it's counted, so the profiler's signal handler never sees a half-built one.
+    CallFrame *frame = &vm.frames[vm.frameCount];
     frame->closure = closure;
     frame->ip = closure->function->chunk.code;
     frame->slots = vm.stackTop - argCount - 1;
+    atomic_signal_fence(memory_order_seq_cst);
+    vm.frameCount++;
+    return true;
+}
+
+// Calls a native with its arguments on top of the stack and replaces them with its result.
+bool callNative(ObjNative *native, int argCount)
+{
+    if (native->arity >= 0 && !checkArity(native->arity, argCount))
+        return false;
+
+    Value *args = vm.stackTop - argCount;
+    Value result;
+    if (!native->function(argCount, args, &result))
+        return false; // The native has reported the error.
+
+    vm.stackTop = args;
+    push(result);
     return true;
 }
 
@@ -190,10 +383,12 @@ static bool callValue(Value callee, int argCount)
             return call(AS_CLOSURE(callee), argCount);
         case OBJ_NATIVE:
         {
-            NativeFn native = AS_NATIVE(callee);
-            Value result = native(argCount, vm.stackTop - argCount);
-            vm.stackTop -= argCount + 1;
-            push(result);
+            if (!callNative(AS_NATIVE(callee), argCount))
+                return false;
+
+            // Drop the callee from under the result.
+            vm.stackTop[-2] = vm.stackTop[-1];
+            vm.stackTop--;
             return true;
         }
         default:
@@ -241,53 +436,126 @@ static void closeUpvalues(Value *last)
            vm.openUpvalues->location >= last)
     {
         ObjUpvalue *upvalue = vm.openUpvalues;
-        upvalue->closed = *upvalue->location;
+        STORE_REFERENCE(upvalue->closed, *upvalue->location);
         upvalue->location = &upvalue->closed;
+        writeBarrier((Obj *)upvalue, upvalue->closed);
         vm.openUpvalues = upvalue->next;
     }
 }
 
+// Calls a closure in tail position by reusing the current frame. The callee and its arguments slide down over
+// the caller's stack window, so tail-recursive code runs in constant stack space.
+static bool tailCall(ObjClosure *closure, int argCount)
+{
+    if (!checkArity(closure->function->arity, argCount))
+        return false;
+
+#ifdef BASELINE_JIT
+    if (vm.jitEnabled)
+        countHotness(closure->function);
+#endif
+
+    CallFrame *frame = &vm.frames[vm.frameCount - 1];
+    closeUpvalues(frame->slots);
+
+    Value *callee = vm.stackTop - argCount - 1;
+    memmove(frame->slots, callee, sizeof(Value) * (argCount + 1));
+    vm.stackTop = frame->slots + argCount + 1;
+
+    frame->closure = closure;
+    frame->ip = closure->function->chunk.code;
+    return true;
+}
+
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
+// Joins the two strings or ropes on top of the stack. Short results are copied and interned as before; longer
+// ones become a rope, so appending to a long string costs the same however long it already is.
 static void concatenate()
 {
-    ObjString *b = AS_STRING(peek(0));
-    ObjString *a = AS_STRING(peek(1));
-
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+    Obj *b = AS_OBJ(peek(0));
+    Obj *a = AS_OBJ(peek(1));
 
-    ObjString *result = takeString(chars, length);
+    int length = textLength(a) + textLength(b);
+    Obj *result;
+    if (length >= ROPE_MIN_LENGTH)
+    {
+        result = (Obj *)newRope(a, b);
+    }
+    else
+    {
+        // Both halves are strings here: a rope is never shorter than ROPE_MIN_LENGTH. The result is put
+        // together on the C stack, so only the string object itself is allocated.
+        char chars[ROPE_MIN_LENGTH];
+        copyText(a, chars);
+        copyText(b, chars + textLength(a));
+        result = (Obj *)copyString(chars, length);
+    }
     pop();
     pop();
     push(OBJ_VAL(result));
 }
 
+// Equality compares strings by identity, which interning makes the same as comparing characters. Ropes aren't
+// interned, so they're flattened in place on the stack before two values are compared.
+static inline void flattenOperands()
+{
+    if (IS_ROPE(peek(0)))
+        vm.stackTop[-1] = OBJ_VAL(flattenRope(AS_ROPE(peek(0))));
+    if (IS_ROPE(peek(1)))
+        vm.stackTop[-2] = OBJ_VAL(flattenRope(AS_ROPE(peek(1))));
+}
+
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_BYTECODE)
+// Debug output printed before each instruction is dispatched.
+static void traceInstruction(CallFrame *frame)
+{
+#ifdef DEBUG_TRACE_EXECUTION
+    printf("          ");
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+    {
+        printf("[ ");
+        printValue(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+#endif
+#ifdef DEBUG_BYTECODE
+    printBytecode(&frame->closure->function->chunk);
+#endif
+}
+#endif
+
 static InterpretResult run()
 {
     CallFrame *frame = &vm.frames[vm.frameCount - 1];
 
-#define READ_BYTE() (*frame->ip++)
+    // The instruction pointer lives in a local so the dispatch stays in registers. It is written back to
+    // frame->ip before anything that looks at the frames (calls, runtime errors, tracing).
+    register uint8_t *ip = frame->ip;
+
+#define READ_BYTE() (*ip++)
 
 #define READ_SHORT() \
-    (frame->ip += 2, \
-     (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
+    (ip += 2,        \
+     (uint16_t)((ip[-2] << 8) | ip[-1]))
 
 #define READ_CONSTANT() \
     (frame->closure->function->chunk.constants.values[READ_BYTE()])
 
-#define READ_STRING() AS_STRING(READ_CONSTANT())
+// For OP_GREATER_EQUAL and OP_LESS_EQUAL, which have to answer exactly like the OP_NOT pairs they replace.
+#define NOT_BOOL_VAL(condition) BOOL_VAL(!(condition))
+
 #define BINARY_OP(ValueType, op)                        \
     do                                                  \
     {                                                   \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
         {                                               \
+            frame->ip = ip;                             \
             runtimeError("Operands must be numbers");   \
             return INTERPRET_RUNTIME_ERROR;             \
         }                                               \
@@ -296,182 +564,385 @@ static InterpretResult run()
         push(ValueType(a op b));                        \
     } while (false)
 
-    for (;;)
-    {
+// Runs compiled functions natively. Native code hands back to run() at the first instruction it doesn't
+// handle itself, so this is tried wherever run() may have switched into or back to a compiled function:
+// after calls, after returns and on loop back-edges.
+#ifdef BASELINE_JIT
+#define ENTER_JIT()                                                       \
+    do                                                                    \
+    {                                                                     \
+        if (vm.jitEnabled && frame->closure->function->jit != NULL)       \
+        {                                                                 \
+            frame->ip = ip;                                               \
+            if (!jitResume(frame))                                        \
+                return INTERPRET_RUNTIME_ERROR;                           \
+            ip = frame->ip;                                               \
+        }                                                                 \
+    } while (false)
+#else
+#define ENTER_JIT() \
+    do              \
+    {               \
+    } while (false)
+#endif
 
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
-        {
-            printf("[ ");
-            printValue(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+// A young collection moves objects, so it only runs between instructions, where every young object still in
+// use is reachable from the VM's roots rather than from a C local. The instructions that do most of the
+// allocating end with this; anything allocated when the nursery is full goes to the old generation, so an
+// instruction without one (a call that reaches a native through OP_CALL, say) costs a little memory at most.
+// Slices of an incremental collection are run from here too.
+#define SAFEPOINT()                          \
+    do                                       \
+    {                                        \
+        if (vm.nurseryTop > vm.nurseryLimit) \
+            collectAtSafepoint();            \
+    } while (false)
+
+#ifdef DEBUG_COUNT_OPCODES
+#define COUNT_INSTRUCTION() countInstruction(frame->closure->function, instruction)
+#else
+#define COUNT_INSTRUCTION() ((void)0)
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
-        {
-        case OP_CONSTANT:
+#if defined(DEBUG_TRACE_EXECUTION) || defined(DEBUG_BYTECODE)
+#define TRACE_INSTRUCTION() (frame->ip = ip, traceInstruction(frame))
+#else
+#define TRACE_INSTRUCTION() \
+    do                      \
+    {                       \
+    } while (false)
+#endif
+
+// Dispatch. With COMPUTED_GOTO every handler ends in its own indirect jump through dispatchTable, so the
+// branch predictor sees one jump site per opcode instead of the single shared jump of the switch.
+#ifdef COMPUTED_GOTO
+    static void *dispatchTable[] = {
+        [OP_CONSTANT] = &&op_OP_CONSTANT,
+        [OP_NIL] = &&op_OP_NIL,
+        [OP_TRUE] = &&op_OP_TRUE,
+        [OP_FALSE] = &&op_OP_FALSE,
+        [OP_POP] = &&op_OP_POP,
+        [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+        [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+        [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+        [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+        [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+        [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+        [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+        [OP_GET_CALLER_LOCAL] = &&op_OP_GET_CALLER_LOCAL,
+        [OP_SET_CALLER_LOCAL] = &&op_OP_SET_CALLER_LOCAL,
+        [OP_EQUAL] = &&op_OP_EQUAL,
+        [OP_GREATER] = &&op_OP_GREATER,
+        [OP_LESS] = &&op_OP_LESS,
+        [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+        [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+        [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+        [OP_ADD] = &&op_OP_ADD,
+        [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+        [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+        [OP_DIVIDE] = &&op_OP_DIVIDE,
+        [OP_NOT] = &&op_OP_NOT,
+        [OP_NEGATE] = &&op_OP_NEGATE,
+        [OP_PRINT] = &&op_OP_PRINT,
+        [OP_JUMP] = &&op_OP_JUMP,
+        [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+        [OP_LOOP] = &&op_OP_LOOP,
+        [OP_CALL] = &&op_OP_CALL,
+        [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+        [OP_CALL_NATIVE] = &&op_OP_CALL_NATIVE,
+        [OP_CLOSURE] = &&op_OP_CLOSURE,
+        [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+        [OP_RETURN] = &&op_OP_RETURN,
+        [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+        [OP_ADD_LOCAL_CONSTANT] = &&op_OP_ADD_LOCAL_CONSTANT,
+        [OP_LESS_LOCAL_CONSTANT_JUMP] = &&op_OP_LESS_LOCAL_CONSTANT_JUMP,
+        [OP_JUMP_IF_FALSE_POP] = &&op_OP_JUMP_IF_FALSE_POP,
+        [OP_SET_LOCAL_POP] = &&op_OP_SET_LOCAL_POP,
+        [OP_SET_GLOBAL_POP] = &&op_OP_SET_GLOBAL_POP,
+        [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+        [OP_ADD_STR] = &&op_OP_ADD_STR,
+        [OP_EQUAL_NUM] = &&op_OP_EQUAL_NUM,
+    };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) op_##op:
+#define DISPATCH()                       \
+    do                                   \
+    {                                    \
+        TRACE_INSTRUCTION();             \
+        instruction = READ_BYTE();       \
+        COUNT_INSTRUCTION();             \
+        goto *dispatchTable[instruction]; \
+    } while (false)
+#else
+#define INTERPRET_LOOP   \
+    loop:                \
+    TRACE_INSTRUCTION(); \
+    switch (instruction = READ_BYTE(), COUNT_INSTRUCTION(), instruction)
+#define CASE(op) case op:
+#define DISPATCH() goto loop
+#endif
+
+    uint8_t instruction;
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT)
         {
             Value constant = READ_CONSTANT();
             push(constant);
-            break;
+            DISPATCH();
         }
-        case OP_NIL:
-            push(NIL_VAL);
-            break;
-        case OP_TRUE:
-            push(BOOL_VAL(true));
-            break;
-        case OP_FALSE:
-            push(BOOL_VAL(false));
-            break;
-        case OP_POP:
-            pop();
-            break;
-        case OP_GET_LOCAL:
+        CASE(OP_NIL)
+        push(NIL_VAL);
+        DISPATCH();
+        CASE(OP_TRUE)
+        push(BOOL_VAL(true));
+        DISPATCH();
+        CASE(OP_FALSE)
+        push(BOOL_VAL(false));
+        DISPATCH();
+        CASE(OP_POP)
+        pop();
+        DISPATCH();
+        CASE(OP_GET_LOCAL)
         {
             uint8_t slot = READ_BYTE();
             push(frame->slots[slot]);
-            break;
+            DISPATCH();
         }
-        case OP_SET_LOCAL:
+        CASE(OP_SET_LOCAL)
         {
             uint8_t slot = READ_BYTE();
             frame->slots[slot] = peek(0);
-            break;
+            DISPATCH();
         }
-        case OP_GET_GLOBAL:
+        CASE(OP_GET_GLOBAL)
         {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!tableGet(&vm.globals, name, &value))
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globalValues.values[slot];
+            if (IS_UNDEFINED(value))
             {
-                runtimeError("Undefined variable '%s'.", name->chars);
+                frame->ip = ip;
+                runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(value);
-            break;
+            DISPATCH();
         }
-        case OP_DEFINE_GLOBAL:
+        CASE(OP_DEFINE_GLOBAL)
         {
-            ObjString *name = READ_STRING();
-            tableSet(&vm.globals, name, peek(0));
+            uint16_t slot = READ_SHORT();
+            vm.globalValues.values[slot] = peek(0);
+            vm.globalCards[slot] = 1;
             pop();
-            break;
+            DISPATCH();
         }
-        case OP_SET_GLOBAL:
+        CASE(OP_SET_GLOBAL)
         {
-            ObjString *name = READ_STRING();
-            if (tableSet(&vm.globals, name, peek(0)))
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
             {
-                tableDelete(&vm.globals, name);
-                runtimeError("Undefined variable '%s'.", name->chars);
+                frame->ip = ip;
+                runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            vm.globalValues.values[slot] = peek(0);
+            vm.globalCards[slot] = 1;
+            DISPATCH();
         }
-        case OP_GET_UPVALUE:
+        CASE(OP_GET_UPVALUE)
         {
             uint8_t slot = READ_BYTE();
             push(*frame->closure->upvalues[slot]->location);
-            break;
+            DISPATCH();
         }
-        case OP_SET_UPVALUE:
+        CASE(OP_SET_UPVALUE)
         {
             uint8_t slot = READ_BYTE();
-            *frame->closure->upvalues[slot]->location = peek(0);
-            break;
+            ObjUpvalue *upvalue = frame->closure->upvalues[slot];
+            overwriteBarrier((Obj *)upvalue, *upvalue->location);
+            STORE_REFERENCE(*upvalue->location, peek(0));
+            writeBarrier((Obj *)upvalue, peek(0));
+            DISPATCH();
+        }
+        CASE(OP_GET_CALLER_LOCAL)
+        {
+            uint8_t slot = READ_BYTE();
+            push(frame[-1].slots[slot]);
+            DISPATCH();
+        }
+        CASE(OP_SET_CALLER_LOCAL)
+        {
+            uint8_t slot = READ_BYTE();
+            frame[-1].slots[slot] = peek(0);
+            DISPATCH();
         }
-        case OP_EQUAL:
+        CASE(OP_EQUAL)
         {
+            if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
+                ip[-1] = OP_EQUAL_NUM;
+
+            flattenOperands();
             Value b = pop();
             Value a = pop();
             push(BOOL_VAL(valuesEqual(a, b)));
-            break;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_GREATER:
-            BINARY_OP(BOOL_VAL, >);
-            break;
-        case OP_LESS:
-            BINARY_OP(BOOL_VAL, <);
-            break;
-        case OP_ADD:
+        CASE(OP_GREATER)
+        BINARY_OP(BOOL_VAL, >);
+        DISPATCH();
+        CASE(OP_LESS)
+        BINARY_OP(BOOL_VAL, <);
+        DISPATCH();
+        CASE(OP_NOT_EQUAL)
+        {
+            flattenOperands();
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL)
+        BINARY_OP(NOT_BOOL_VAL, <);
+        DISPATCH();
+        CASE(OP_LESS_EQUAL)
+        BINARY_OP(NOT_BOOL_VAL, >);
+        DISPATCH();
+        CASE(OP_ADD)
         {
-            if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
+            // Quickens this instruction for the operand types seen on this execution.
+            if (IS_TEXT(peek(0)) && IS_TEXT(peek(1)))
             {
+                ip[-1] = OP_ADD_STR;
                 concatenate();
+                SAFEPOINT();
             }
             else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
             {
+                ip[-1] = OP_ADD_NUM;
                 double b = AS_NUMBER(pop());
                 double a = AS_NUMBER(pop());
                 push(NUMBER_VAL(a + b));
             }
             else
             {
+                frame->ip = ip;
                 runtimeError("Operands must be two numbers or two strings. | Psalms 37:24\nthough he may stumble, he will not fall, for the LORD upholds him with his hand.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            break;
+            DISPATCH();
         }
-        case OP_SUBTRACT:
-            BINARY_OP(NUMBER_VAL, -);
-            break;
-        case OP_MULTIPLY:
-            BINARY_OP(NUMBER_VAL, *);
-            break;
-        case OP_DIVIDE:
-            BINARY_OP(NUMBER_VAL, /);
-            break;
-        case OP_NOT:
-            push(BOOL_VAL(isFalsey(pop())));
-            break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(0)))
-            {
-                runtimeError("Operand must be a number.");
-            }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
-            break;
-        case OP_PRINT:
+        CASE(OP_SUBTRACT)
+        BINARY_OP(NUMBER_VAL, -);
+        DISPATCH();
+        CASE(OP_MULTIPLY)
+        BINARY_OP(NUMBER_VAL, *);
+        DISPATCH();
+        CASE(OP_DIVIDE)
+        BINARY_OP(NUMBER_VAL, /);
+        DISPATCH();
+        CASE(OP_NOT)
+        push(BOOL_VAL(isFalsey(pop())));
+        DISPATCH();
+        CASE(OP_NEGATE)
+        if (!IS_NUMBER(peek(0)))
+        {
+            frame->ip = ip;
+            runtimeError("Operand must be a number.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        push(NUMBER_VAL(-AS_NUMBER(pop())));
+        DISPATCH();
+        CASE(OP_PRINT)
         {
             printValue(pop());
-            break;
+            DISPATCH();
         }
-        case OP_JUMP:
+        CASE(OP_JUMP)
         {
             uint16_t offset = READ_SHORT();
-            frame->ip += offset;
-            break;
+            ip += offset;
+            DISPATCH();
         }
-        case OP_JUMP_IF_FALSE:
+        CASE(OP_JUMP_IF_FALSE)
         {
             uint16_t offset = READ_SHORT();
             if (isFalsey(peek(0)))
-                frame->ip += offset;
-            break;
+                ip += offset;
+            DISPATCH();
         }
-        case OP_LOOP:
+        CASE(OP_LOOP)
         {
             uint16_t offset = READ_SHORT();
-            frame->ip -= offset;
-            break;
+            ip -= offset;
+            frame->ip = ip; // Lets the profiler place samples of a long-running loop.
+#ifdef BASELINE_JIT
+            if (vm.jitEnabled)
+                countHotness(frame->closure->function);
+#endif
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_CALL:
+        CASE(OP_CALL)
         {
             int argCount = READ_BYTE();
+            frame->ip = ip;
             if (!callValue(peek(argCount), argCount))
             {
                 return INTERPRET_RUNTIME_ERROR;
             }
             frame = &vm.frames[vm.frameCount - 1];
-            break;
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_TAIL_CALL)
+        {
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            Value callee = peek(argCount);
+            // Natives don't get a frame, so they go through the normal path and the OP_RETURN after this.
+            if (IS_CLOSURE(callee) ? !tailCall(AS_CLOSURE(callee), argCount) : !callValue(callee, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
         }
-        case OP_CLOSURE:
+        CASE(OP_CALL_NATIVE)
+        {
+            uint16_t slot = READ_SHORT();
+            int argCount = READ_BYTE();
+            frame->ip = ip;
+            Value callee = vm.globalValues.values[slot];
+            if (IS_NATIVE(callee))
+            {
+                if (!callNative(AS_NATIVE(callee), argCount))
+                    return INTERPRET_RUNTIME_ERROR;
+                SAFEPOINT();
+                ENTER_JIT();
+                DISPATCH();
+            }
+
+            // The script has put something else in the global since this was compiled. Slide the arguments
+            // up to make room for the callee under them and make an ordinary call.
+            memmove(vm.stackTop - argCount + 1, vm.stackTop - argCount, sizeof(Value) * argCount);
+            vm.stackTop[-argCount] = callee;
+            vm.stackTop++;
+            if (!callValue(callee, argCount))
+            {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            frame = &vm.frames[vm.frameCount - 1];
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
+        }
+        CASE(OP_CLOSURE)
         {
             ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
             ObjClosure *closure = newClosure(function);
@@ -483,21 +954,23 @@ static InterpretResult run()
                 uint8_t index = READ_BYTE();
                 if (isLocal)
                 {
-                    closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                    STORE_REFERENCE(closure->upvalues[i], captureUpvalue(frame->slots + index));
                 }
                 else
                 {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
+                    STORE_REFERENCE(closure->upvalues[i], frame->closure->upvalues[index]);
                 }
+                writeBarrier((Obj *)closure, OBJ_VAL(closure->upvalues[i]));
             }
 
-            break;
+            SAFEPOINT();
+            DISPATCH();
         }
-        case OP_CLOSE_UPVALUE:
-            closeUpvalues(vm.stackTop - 1);
-            pop();
-            break;
-        case OP_RETURN:
+        CASE(OP_CLOSE_UPVALUE)
+        closeUpvalues(vm.stackTop - 1);
+        pop();
+        DISPATCH();
+        CASE(OP_RETURN)
         {
             Value result = pop();
             closeUpvalues(frame->slots);
@@ -512,22 +985,160 @@ static InterpretResult run()
             vm.stackTop = frame->slots;
             push(result);
             frame = &vm.frames[vm.frameCount - 1];
-            break;
+            ip = frame->ip;
+            ENTER_JIT();
+            DISPATCH();
             // printValue(pop());
             // printf("\n");
             // Exit interpreter.
         }
+
+        // Superinstructions. ip points just past the fused opcode; the operands and the remaining opcodes of
+        // the original sequence follow it unchanged (see optimizer.c). When the operands aren't numbers the
+        // handler runs the sequence's first instruction and dispatches the rest of it normally.
+        CASE(OP_ADD_LOCALS)
+        {
+            Value a = frame->slots[ip[0]];
+            Value b = frame->slots[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                ip += 4;
+                DISPATCH();
+            }
+            push(a);
+            ip += 1;
+            DISPATCH();
+        }
+        CASE(OP_ADD_LOCAL_CONSTANT)
+        {
+            Value a = frame->slots[ip[0]];
+            Value b = frame->closure->function->chunk.constants.values[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                push(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+                ip += 4;
+                DISPATCH();
+            }
+            push(a);
+            ip += 1;
+            DISPATCH();
+        }
+        CASE(OP_LESS_LOCAL_CONSTANT_JUMP)
+        {
+            Value a = frame->slots[ip[0]];
+            Value b = frame->closure->function->chunk.constants.values[ip[2]];
+            if (IS_NUMBER(a) && IS_NUMBER(b))
+            {
+                if (AS_NUMBER(a) < AS_NUMBER(b))
+                {
+                    // The condition would be pushed and then popped by the fused OP_POP.
+                    ip += 8;
+                }
+                else
+                {
+                    // The jump target pops the condition itself.
+                    push(BOOL_VAL(false));
+                    ip += 7 + (uint16_t)((ip[5] << 8) | ip[6]);
+                }
+                DISPATCH();
+            }
+            push(a);
+            ip += 1;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_POP)
+        {
+            uint16_t offset = READ_SHORT();
+            if (isFalsey(peek(0)))
+            {
+                ip += offset;
+            }
+            else
+            {
+                pop();
+                ip++;
+            }
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL_POP)
+        {
+            uint8_t slot = READ_BYTE();
+            frame->slots[slot] = pop();
+            ip++;
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP)
+        {
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globalValues.values[slot]))
+            {
+                frame->ip = ip;
+                runtimeError("Undefined variable '%s'.", AS_CSTRING(vm.globalNames.values[slot]));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globalValues.values[slot] = pop();
+            vm.globalCards[slot] = 1;
+            ip++;
+            DISPATCH();
+        }
+
+        // Quickened instructions. Each guards its operand types; on a miss it deoptimizes by putting the
+        // generic opcode back and re-dispatching the same instruction through it.
+        CASE(OP_ADD_NUM)
+        {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+            {
+                ip[-1] = OP_ADD;
+                ip--;
+                DISPATCH();
+            }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(NUMBER_VAL(a + b));
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR)
+        {
+            if (!IS_TEXT(peek(0)) || !IS_TEXT(peek(1)))
+            {
+                ip[-1] = OP_ADD;
+                ip--;
+                DISPATCH();
+            }
+            concatenate();
+            SAFEPOINT();
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM)
+        {
+            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1)))
+            {
+                ip[-1] = OP_EQUAL;
+                ip--;
+                DISPATCH();
+            }
+            double b = AS_NUMBER(pop());
+            double a = AS_NUMBER(pop());
+            push(BOOL_VAL(a == b));
+            DISPATCH();
         }
-#ifdef DEBUG_BYTECODE
-        printBytecode(&frame->closure->function->chunk);
-#endif
     }
 
+    // Unknown opcodes fall out of the switch; keep looping like the original interpreter did.
+    DISPATCH();
+
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
-#undef READ_STRING
 #undef BINARY_OP
+#undef ENTER_JIT
+#undef SAFEPOINT
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
 InterpretResult interpret(const char *source)
@@ -536,11 +1147,24 @@ InterpretResult interpret(const char *source)
     if (function == NULL)
         return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(function);
+}
+
+// Runs an already compiled script function, such as one loaded from a bytecode cache.
+InterpretResult interpretFunction(ObjFunction *function)
+{
     push(OBJ_VAL(function));
     ObjClosure *closure = newClosure(function);
     pop();
     push(OBJ_VAL(closure));
     call(closure, 0);
 
-    return run();
+    // Young objects only exist while run() is executing. Whatever is still reachable when it returns is moved to
+    // the old generation, so the compiler, the loaders and the host never see the nursery. Incremental
+    // collections likewise only run in run(): the young collection finishes one still in progress.
+    vm.nurseryOpen = true;
+    InterpretResult result = run();
+    vm.nurseryOpen = false;
+    collectYoung();
+    return result;
 }
\ No newline at end of file
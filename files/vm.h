@@ -6,8 +6,10 @@
 #include "value.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The value stack and the frame array start small and grow as calls nest. FRAMES_MAX only exists so runaway
+// recursion ends in "Stack overflow." rather than in exhausting memory.
+#define FRAMES_MAX (1 << 20)
+#define FRAME_STACK_SLOTS (UINT8_COUNT * 2) // Free stack call() guarantees a new frame: locals and temporaries.
 
 typedef struct
 {
@@ -16,24 +18,68 @@ typedef struct
     Value *slots;
 } CallFrame;
 
+// Where an incremental collection of the old generation is (see memory.c).
+typedef enum
+{
+    GC_IDLE,
+    GC_MARK,
+    GC_SWEEP
+} GcPhase;
+
+// Objects that have been marked but whose references haven't been marked yet.
+typedef struct
+{
+    int count;
+    int capacity;
+    Obj **objects;
+} GrayStack;
+
 typedef struct
 {
-    CallFrame frames[FRAMES_MAX];
+    CallFrame *frames;
     int frameCount;
+    int frameCapacity;
 
-    Value stack[STACK_MAX];
+    Value *stack; // Moves when it grows; frame slots and open upvalues are rebased onto the new block.
     Value *stackTop;
+    int stackCapacity;
     Table strings;
     ObjUpvalue *openUpvalues;
-    Table globals;
+
+    // Globals live in a dense array. The compiler resolves every global name to a slot once, so
+    // OP_GET_GLOBAL and friends index straight into globalValues instead of probing a hash table.
+    Table globalSlots;       // Name -> slot index, stored as a number.
+    ValueArray globalValues; // Slot -> value. UNDEFINED_VAL until the global's definition runs.
+    ValueArray globalNames;  // Slot -> name, for error messages.
+    uint8_t *globalCards;    // Slot -> nonzero if the value was stored while the nursery was open.
+    int globalCardCapacity;
+
+#ifdef BASELINE_JIT
+    bool jitEnabled; // Set by --jit. Hot functions get compiled to native code.
+#endif
 
     size_t bytesAllocated;
     size_t nextGC;
 
     Obj *objects;
-    int grayCount;
-    int grayCapacity;
-    Obj **grayStack;
+    GrayStack gray;
+
+    // Incremental collection of the old generation. With a pause budget, a collection is spread over slices that
+    // each take about that long, interleaved with allocation; without one it runs to completion at once.
+    uint32_t gcPauseBudget; // Microseconds per slice, or 0 to collect without stopping. Set by --gc-pause.
+    GcPhase gcPhase;
+    Obj *sweeping;          // Old objects the sweep phase hasn't got to yet.
+    size_t nextSlice;       // bytesAllocated at which the next slice is due.
+    bool gcConcurrent;      // Set by --gc-concurrent. Marking runs on a thread of its own (see memory.c).
+
+    // The young generation (see memory.h). The nursery only holds objects while run() is executing.
+    uint8_t *nursery;       // NURSERY_SIZE bytes.
+    uint8_t *nurseryTop;    // Next free byte.
+    uint8_t *nurseryLimit;  // run() calls the collector at the next safepoint once nurseryTop passes this.
+    bool nurseryOpen;       // Set while run() is executing; outside it everything is allocated old.
+    Obj **remembered;       // Old objects that may point into the nursery.
+    int rememberedCount;
+    int rememberedCapacity;
 } VM;
 
 typedef enum
@@ -48,6 +94,11 @@ extern VM vm;
 void initVM();
 void freeVM();
 InterpretResult interpret(const char *source);
+InterpretResult interpretFunction(ObjFunction *function);
+void defineNative(const char *name, NativeFn function, int arity, uint8_t flags);
+bool nativeError(const char *format, ...);
+bool callNative(ObjNative *native, int argCount);
+int globalSlot(ObjString *name);
 void push(Value value);
 Value pop();
 